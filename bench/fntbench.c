@@ -0,0 +1,197 @@
+#include <err.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrender.h>
+
+#include "../ctrlfnt.h"
+
+#define NITERS      1000        /* default number of operations per measure */
+#define WIDTH       2048
+#define HEIGHT      64
+
+/*
+ * Measure ctrlfnt_width() and ctrlfnt_draw() on each backend chosen by
+ * ctrlfnt_open() (Xft, XLFD font set and core font), for corpora of
+ * different scripts and lengths.  Each row opens the font anew, so the
+ * first call pays for the search of fallback fonts; the counters are
+ * those of ctrlfnt_stats() over the whole row.
+ */
+
+static const char *backends[][2] = {
+	{ "xft",     "xft:monospace:size=10" },
+	{ "fontset", "x:-*-*-medium-r-normal--13-*-*-*-*-*-*-*,-*-*-*-*-*--*-*-*-*-*-*-*-*" },
+	{ "core",    "x:fixed" },
+};
+
+static const char *corpora[][2] = {
+	{ "ascii",   "The quick brown fox jumps over the lazy dog. " },
+	{ "latin",   "Ça déjà vu: naïve façade, Straße, Øresund, señor. " },
+	{ "cjk",     "東京の天気は晴れ時々曇り。今日は会議があります。" },
+	{ "emoji",   "Battery low \xf0\x9f\x94\x8b plug in \xf0\x9f\x94\x8c now \xe2\x9a\xa1 " },
+	{ "mixed",   "Build ok \xe2\x9c\x94 完成 — Ошибка: αβγ שלום \xf0\x9f\x9a\x80 " },
+};
+
+static const int lengths[] = { 16, 128, 1024 };
+
+static long long
+getnsec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char *
+mktext(const char *s, int size, int *nbytes)
+{
+	size_t len;
+	char *buf;
+	int i;
+
+	/* repeat s up to size bytes, without cutting a character in two */
+	len = strlen(s);
+	if ((buf = malloc(size + 1)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < size; i++)
+		buf[i] = s[i % len];
+	while (i > 0 && (s[i % len] & 0xC0) == 0x80)
+		i--;
+	buf[i] = '\0';
+	*nbytes = i;
+	return buf;
+}
+
+static void
+bench(Display *dpy, Picture picture, Picture src, const char *backend,
+      const char *fontspec, const char *corpus, const char *text,
+      int nbytes, long niters, size_t ncache)
+{
+	CtrlFontSet *fontset;
+	CtrlFontStats stats;
+	XRectangle rect = { 0, 0, WIDTH, HEIGHT };
+	long long t0, t1, cold, width, draw;
+	long i;
+	int sum = 0;
+
+	fontset = ctrlfnt_open(
+		dpy,
+		DefaultScreen(dpy),
+		DefaultVisual(dpy, DefaultScreen(dpy)),
+		DefaultColormap(dpy, DefaultScreen(dpy)),
+		fontspec,
+		0.0
+	);
+	if (fontset == NULL) {
+		warnx("%s: could not open backend", backend);
+		return;
+	}
+	if (ncache > 0 && ctrlfnt_cache(fontset, ncache) == -1)
+		err(1, "ctrlfnt_cache");
+
+	t0 = getnsec();
+	sum += ctrlfnt_width(fontset, text, nbytes);
+	t1 = getnsec();
+	cold = t1 - t0;
+
+	t0 = getnsec();
+	for (i = 0; i < niters; i++)
+		sum += ctrlfnt_width(fontset, text, nbytes);
+	t1 = getnsec();
+	width = t1 - t0;
+
+	/* wait for the server to be done with the drawing */
+	XSync(dpy, False);
+	t0 = getnsec();
+	for (i = 0; i < niters; i++)
+		(void)ctrlfnt_draw(fontset, picture, src, rect, text, nbytes);
+	XSync(dpy, False);
+	t1 = getnsec();
+	draw = t1 - t0;
+
+	ctrlfnt_stats(fontset, &stats);
+	printf("%-8s %-7s %6d %10lld %10lld %10lld %8lu %8lu %8lu\n",
+	       backend, corpus, nbytes, cold,
+	       width / niters, draw / niters,
+	       stats.font_matches, stats.char_lookups, stats.fallback_opens);
+	/* keep the compiler from optimizing the measures away */
+	if (sum == 0)
+		printf("(no width)\n");
+	ctrlfnt_free(fontset);
+}
+
+int
+main(int argc, char *argv[])
+{
+	Display *dpy;
+	Pixmap pix;
+	Picture picture, src;
+	XRenderPictFormat *format;
+	size_t b, c, l, ncache;
+	long niters;
+	char *text;
+	int nbytes, ch;
+
+	niters = NITERS;
+	ncache = 0;
+	while ((ch = getopt(argc, argv, "c:n:")) != -1) {
+		switch (ch) {
+		case 'c':
+			ncache = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			if ((niters = strtol(optarg, NULL, 10)) <= 0)
+				errx(1, "%s: invalid number of operations", optarg);
+			break;
+		default:
+			(void)fprintf(stderr, "usage: fntbench [-c entries] [-n operations]\n");
+			return 1;
+		}
+	}
+	/* XLFD font sets need the locale to read UTF-8 */
+	if (setlocale(LC_CTYPE, "") == NULL || !XSupportsLocale())
+		warnx("warning: no locale support");
+	if ((dpy = XOpenDisplay(NULL)) == NULL)
+		errx(1, "could not open display");
+	ctrlfnt_init();
+	pix = XCreatePixmap(
+		dpy,
+		DefaultRootWindow(dpy),
+		WIDTH, HEIGHT,
+		DefaultDepth(dpy, DefaultScreen(dpy))
+	);
+	format = XRenderFindVisualFormat(dpy, DefaultVisual(dpy, DefaultScreen(dpy)));
+	if (format == NULL)
+		errx(1, "could not find picture format");
+	picture = XRenderCreatePicture(dpy, pix, format, 0, NULL);
+	src = XRenderCreateSolidFill(dpy, &(XRenderColor){
+		.red = 0xFFFF, .green = 0xFFFF, .blue = 0xFFFF, .alpha = 0xFFFF,
+	});
+	printf("%-8s %-7s %6s %10s %10s %10s %8s %8s %8s\n",
+	       "backend", "corpus", "bytes", "cold(ns)", "width(ns)", "draw(ns)",
+	       "fcmatch", "charexst", "fallback");
+	for (b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+		for (c = 0; c < sizeof(corpora) / sizeof(corpora[0]); c++) {
+			for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+				text = mktext(corpora[c][1], lengths[l], &nbytes);
+				bench(dpy, picture, src, backends[b][0],
+				      backends[b][1], corpora[c][0],
+				      text, nbytes, niters, ncache);
+				free(text);
+			}
+		}
+	}
+	XRenderFreePicture(dpy, src);
+	XRenderFreePicture(dpy, picture);
+	XFreePixmap(dpy, pix);
+	XCloseDisplay(dpy);
+	ctrlfnt_term();
+	return 0;
+}
@@ -0,0 +1,153 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../parse.h"
+
+#define NLINES      1000000     /* default number of lines per corpus */
+
+/*
+ * Measure the throughput of the notification parser, in lines per
+ * second, the way parseline() in xnotify uses it: each line is split in
+ * place into its options, title and body, and the slices of the body
+ * lines are collected into an array kept from a line to the next one.
+ * What is left to xnotify is the single copy of the slices into the
+ * notification.
+ */
+
+static const char *corpora[][2] = {
+	{ "title",   "Hello world\n" },
+	{ "body",    "Battery low\tPlease plug in the charger\tRemaining: 5%\n" },
+	{ "options", "IMG:/usr/share/icons/dialog-warning.png\tBG:#202020\tFG:#FFFFFF\t"
+	             "BRD:#FF0000\tTAG:battery\tCMD:battery-info\tSEC:2.5\tBAR:5\t"
+	             "Battery low\tPlease plug in the charger\n" },
+	{ "long",    NULL },        /* filled by mklong() */
+};
+
+static long long
+getnsec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char *
+mklong(void)
+{
+	static const char word[] = "lorem ipsum dolor sit amet\t";
+	char *s, *p;
+	int i;
+
+	/* a title followed by a body of 64 lines */
+	if ((s = malloc(sizeof("Long\t") + 64 * (sizeof(word) - 1) + 1)) == NULL)
+		err(1, "malloc");
+	p = s + sprintf(s, "Long\t");
+	for (i = 0; i < 64; i++)
+		p += sprintf(p, "%s", word);
+	p[-1] = '\n';
+	return s;
+}
+
+static char *
+mkcorpus(const char *line, long nlines, size_t *size)
+{
+	size_t len;
+	char *buf;
+	long i;
+
+	len = strlen(line);
+	*size = len * nlines;
+	if ((buf = malloc(*size + 1)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < nlines; i++)
+		memcpy(buf + i * len, line, len);
+	buf[*size] = '\0';
+	return buf;
+}
+
+static unsigned long
+parsecorpus(const char *buf, size_t size, long *nlines)
+{
+	static ParseSlice *lines = NULL;
+	static size_t maxlines = 0;
+	ParseSpec spec;
+	ParseSlice field;
+	const char *line, *nl, *end;
+	unsigned long sum = 0;
+	size_t i, n, pos, len;
+
+	*nlines = 0;
+	end = buf + size;
+	for (line = buf; line < end; line = nl + 1) {
+		if ((nl = memchr(line, '\n', end - line)) == NULL)
+			nl = end;
+		len = nl - line;
+		(*nlines)++;
+		if (parse_spec(line, len, &spec) == -1)
+			continue;
+		n = 0;
+		pos = spec.body.off;
+		while (parse_field(line, spec.body.off + spec.body.len, &pos, &field)) {
+			if (n == maxlines) {
+				maxlines = (maxlines == 0) ? 16 : maxlines * 2;
+				if ((lines = realloc(lines, maxlines * sizeof(*lines))) == NULL)
+					err(1, "realloc");
+			}
+			lines[n++] = field;
+		}
+		sum += spec.options + spec.title.len;
+		for (i = 0; i < n; i++)
+			sum += lines[i].len;
+	}
+	return sum;
+}
+
+int
+main(int argc, char *argv[])
+{
+	long nlines, parsed;
+	long long t0, t1;
+	unsigned long sum;
+	size_t i, size;
+	char *buf;
+	int ch;
+
+	nlines = NLINES;
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			if ((nlines = strtol(optarg, NULL, 10)) <= 0)
+				errx(1, "%s: invalid number of lines", optarg);
+			break;
+		default:
+			(void)fprintf(stderr, "usage: parsebench [-n lines]\n");
+			return 1;
+		}
+	}
+	corpora[3][1] = mklong();
+	printf("%-10s %12s %14s %10s\n", "corpus", "lines", "lines/s", "MB/s");
+	for (i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++) {
+		buf = mkcorpus(corpora[i][1], nlines, &size);
+		t0 = getnsec();
+		sum = parsecorpus(buf, size, &parsed);
+		t1 = getnsec();
+		if (t1 <= t0)
+			t1 = t0 + 1;
+		printf("%-10s %12ld %14.0f %10.1f\n",
+		       corpora[i][0], parsed,
+		       parsed * 1e9 / (t1 - t0),
+		       size * 1e9 / (t1 - t0) / 1e6);
+		/* keep the compiler from optimizing the parsing away */
+		if (sum == 0)
+			printf("(no fields)\n");
+		free(buf);
+	}
+	free((char *)corpora[3][1]);
+	return 0;
+}
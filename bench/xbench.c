@@ -0,0 +1,614 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <X11/Xlib.h>
+
+/*
+ * End-to-end benchmark of xnotify.
+ *
+ * xnotify is run on the display through a proxy that counts the X
+ * requests it sends.  Synthetic workloads are written to its standard
+ * input in rounds: each round writes a batch of lines at once and waits
+ * for the windows to be mapped.  The root window is watched for
+ * MapNotify and UnmapNotify events.  For each workload, the time from
+ * writing a round to each map, the throughput, the number of requests
+ * per notification and the resident memory of xnotify are reported.
+ */
+
+#define MAXCONNS    8           /* maximum number of proxied connections */
+#define MAXWINS     1024        /* maximum number of windows mapped at once */
+#define PROXYBUF    65536
+#define QUIET       1000        /* milliseconds without a map to end a round */
+#define SETTLE      100         /* milliseconds without requests to be idle */
+#define NIMAGES     4
+#define LONGBODY    2000        /* length of the body of the long workload */
+
+struct Conn {
+	int cfd, sfd;                   /* client and server sides */
+	int setup;                      /* whether the setup request was read */
+	int bigendian;
+	unsigned char hdr[12];
+	size_t nhdr;
+	size_t skip;                    /* bytes left of the current request */
+};
+
+struct Workload {
+	const char *name;
+	int nrounds;
+	int nlines;                     /* lines written per round */
+	int nmaps;                      /* maps expected per round */
+	void (*mkline)(char *buf, size_t size, int round, int i);
+};
+
+static struct Conn conns[MAXCONNS];
+static int nconns;
+static int listenfd = -1;
+static char serverpath[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static unsigned long nrequests;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static Display *dpy;
+static Window mapped[MAXWINS];
+static int nmapped;
+static long long maptimes[MAXWINS];
+static int nmaptimes;
+
+static char imgdir[] = "/tmp/xbench.XXXXXX";
+
+static long long
+getusec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned long
+getcard(const unsigned char *p, int n, int bigendian)
+{
+	unsigned long v = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		v |= (unsigned long)p[bigendian ? i : n - 1 - i] << (8 * (n - 1 - i));
+	return v;
+}
+
+static void
+countrequests(struct Conn *conn, const unsigned char *p, size_t n)
+{
+	unsigned long len, count = 0;
+	size_t k;
+
+	/*
+	 * Follow the stream of requests from the client to the server.
+	 * After the setup request, each request begins with a four-byte
+	 * header whose second half is its length in four-byte units; a
+	 * length of zero (BIG-REQUESTS) is followed by a four-byte length.
+	 */
+	while (n > 0) {
+		if (conn->skip > 0) {
+			k = (conn->skip < n) ? conn->skip : n;
+			conn->skip -= k;
+			p += k;
+			n -= k;
+			continue;
+		}
+		conn->hdr[conn->nhdr++] = *p++;
+		n--;
+		if (!conn->setup) {
+			if (conn->nhdr < 12)
+				continue;
+			conn->bigendian = (conn->hdr[0] == 'B');
+			conn->skip = (getcard(conn->hdr + 6, 2, conn->bigendian) + 3) / 4 * 4;
+			conn->skip += (getcard(conn->hdr + 8, 2, conn->bigendian) + 3) / 4 * 4;
+			conn->setup = 1;
+			conn->nhdr = 0;
+			continue;
+		}
+		if (conn->nhdr < 4)
+			continue;
+		if ((len = getcard(conn->hdr + 2, 2, conn->bigendian)) == 0) {
+			if (conn->nhdr < 8)
+				continue;
+			len = getcard(conn->hdr + 4, 4, conn->bigendian);
+		}
+		conn->skip = (len * 4 > conn->nhdr) ? len * 4 - conn->nhdr : 0;
+		conn->nhdr = 0;
+		count++;
+	}
+	pthread_mutex_lock(&mutex);
+	nrequests += count;
+	pthread_mutex_unlock(&mutex);
+}
+
+static unsigned long
+getrequests(void)
+{
+	unsigned long n;
+
+	pthread_mutex_lock(&mutex);
+	n = nrequests;
+	pthread_mutex_unlock(&mutex);
+	return n;
+}
+
+static int
+writeall(int fd, const void *buf, size_t n)
+{
+	const char *p = buf;
+	ssize_t w;
+
+	while (n > 0) {
+		if ((w = write(fd, p, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += w;
+		n -= w;
+	}
+	return 0;
+}
+
+static void
+closeconn(int i)
+{
+	close(conns[i].cfd);
+	close(conns[i].sfd);
+	conns[i] = conns[--nconns];
+}
+
+static void
+acceptconn(void)
+{
+	struct sockaddr_un addr;
+	int cfd, sfd;
+
+	if ((cfd = accept(listenfd, NULL, NULL)) == -1)
+		return;
+	if (nconns == MAXCONNS || (sfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		close(cfd);
+		return;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, serverpath, sizeof(addr.sun_path));
+	if (connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		warn("%s", serverpath);
+		close(cfd);
+		close(sfd);
+		return;
+	}
+	conns[nconns++] = (struct Conn){ .cfd = cfd, .sfd = sfd };
+}
+
+static void *
+proxy(void *arg)
+{
+	static unsigned char buf[PROXYBUF];
+	struct pollfd pfd[1 + 2 * MAXCONNS];
+	ssize_t n;
+	int i;
+
+	(void)arg;
+	for (;;) {
+		pfd[0].fd = listenfd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < nconns; i++) {
+			pfd[1 + 2 * i].fd = conns[i].cfd;
+			pfd[2 + 2 * i].fd = conns[i].sfd;
+			pfd[1 + 2 * i].events = pfd[2 + 2 * i].events = POLLIN;
+		}
+		if (poll(pfd, 1 + 2 * nconns, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		for (i = nconns - 1; i >= 0; i--) {
+			if (pfd[1 + 2 * i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				if ((n = read(conns[i].cfd, buf, sizeof(buf))) <= 0 ||
+				    writeall(conns[i].sfd, buf, n) == -1) {
+					closeconn(i);
+					continue;
+				}
+				countrequests(&conns[i], buf, n);
+			}
+			if (pfd[2 + 2 * i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				if ((n = read(conns[i].sfd, buf, sizeof(buf))) <= 0 ||
+				    writeall(conns[i].cfd, buf, n) == -1) {
+					closeconn(i);
+					continue;
+				}
+			}
+		}
+		if (pfd[0].revents & POLLIN) {
+			acceptconn();
+		}
+	}
+	return NULL;
+}
+
+static void
+initproxy(int display, int proxydisplay)
+{
+	struct sockaddr_in addr;
+	pthread_t thread;
+	int on = 1;
+
+	(void)snprintf(serverpath, sizeof(serverpath), "/tmp/.X11-unix/X%d", display);
+	if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	(void)setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(6000 + proxydisplay);
+	if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		err(1, "bind");
+	if (listen(listenfd, MAXCONNS) == -1)
+		err(1, "listen");
+	if ((errno = pthread_create(&thread, NULL, proxy, NULL)) != 0)
+		err(1, "pthread_create");
+	(void)pthread_detach(thread);
+}
+
+static int
+pump(int msec)
+{
+	struct pollfd pfd;
+	long long deadline, now;
+	XEvent ev;
+	int i, nevents = 0;
+
+	/*
+	 * Wait up to msec milliseconds for windows to be mapped or unmapped
+	 * on the root window, and keep track of them.  Return the number
+	 * of windows mapped or unmapped.
+	 */
+	pfd.fd = ConnectionNumber(dpy);
+	pfd.events = POLLIN;
+	deadline = getusec() + msec * 1000LL;
+	for (;;) {
+		while (XPending(dpy)) {
+			XNextEvent(dpy, &ev);
+			switch (ev.type) {
+			case MapNotify:
+				if (!ev.xmap.override_redirect || nmapped == MAXWINS)
+					break;
+				mapped[nmapped++] = ev.xmap.window;
+				if (nmaptimes < MAXWINS)
+					maptimes[nmaptimes++] = getusec();
+				nevents++;
+				break;
+			case UnmapNotify:
+				for (i = 0; i < nmapped; i++) {
+					if (mapped[i] == ev.xunmap.window) {
+						mapped[i] = mapped[--nmapped];
+						nevents++;
+						break;
+					}
+				}
+				break;
+			}
+		}
+		if (nevents > 0 || (now = getusec()) >= deadline)
+			return nevents;
+		(void)poll(&pfd, 1, (deadline - now + 999) / 1000);
+	}
+}
+
+static void
+settle(void)
+{
+	unsigned long n;
+
+	/* wait until xnotify stops sending requests */
+	do {
+		n = getrequests();
+		(void)pump(SETTLE);
+	} while (getrequests() != n);
+}
+
+static void
+clearscreen(pid_t pid)
+{
+	int i;
+
+	/* close every notification, until none is left on the screen */
+	for (i = 0; i < 10; i++) {
+		if (nmapped > 0)
+			(void)kill(pid, SIGHUP);
+		while (pump(200) > 0)
+			;
+		if (nmapped == 0) {
+			settle();
+			return;
+		}
+	}
+	warnx("notifications are not closed");
+}
+
+static long
+getrss(pid_t pid)
+{
+	char path[64], line[256];
+	long kb = -1;
+	FILE *fp;
+
+	/* resident set size in kilobytes, if /proc(5) is there */
+	(void)snprintf(path, sizeof(path), "/proc/%ld/status", (long)pid);
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fp) != NULL)
+		if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+			break;
+	fclose(fp);
+	return kb;
+}
+
+static void
+mkimages(void)
+{
+	char path[sizeof(imgdir) + 16];
+	FILE *fp;
+	int i, x, y;
+
+	/* plain PPM images, which any Imlib2 can load */
+	if (mkdtemp(imgdir) == NULL)
+		err(1, "mkdtemp");
+	for (i = 0; i < NIMAGES; i++) {
+		(void)snprintf(path, sizeof(path), "%s/%d.ppm", imgdir, i);
+		if ((fp = fopen(path, "w")) == NULL)
+			err(1, "%s", path);
+		fprintf(fp, "P6\n%d %d\n255\n", 128 * (i + 1), 128 * (i + 1));
+		for (y = 0; y < 128 * (i + 1); y++) {
+			for (x = 0; x < 128 * (i + 1); x++) {
+				putc(x * 255 / (128 * (i + 1)), fp);
+				putc(y * 255 / (128 * (i + 1)), fp);
+				putc(i * 255 / NIMAGES, fp);
+			}
+		}
+		if (fclose(fp) == EOF)
+			err(1, "%s", path);
+	}
+}
+
+static void
+rmimages(void)
+{
+	char path[sizeof(imgdir) + 16];
+	int i;
+
+	for (i = 0; i < NIMAGES; i++) {
+		(void)snprintf(path, sizeof(path), "%s/%d.ppm", imgdir, i);
+		(void)unlink(path);
+	}
+	(void)rmdir(imgdir);
+}
+
+static void
+mksingle(char *buf, size_t size, int round, int i)
+{
+	(void)snprintf(buf, size, "Single %d.%d\tA notification on its own\n", round, i);
+}
+
+static void
+mkburst(char *buf, size_t size, int round, int i)
+{
+	(void)snprintf(buf, size, "Burst %d.%d\tOne of many notifications at once\n", round, i);
+}
+
+static void
+mktagchurn(char *buf, size_t size, int round, int i)
+{
+	(void)snprintf(buf, size, "TAG:churn\tBAR:%d\tProgress %d.%d\n", i * 100 / 16, round, i);
+}
+
+static void
+mkimage(char *buf, size_t size, int round, int i)
+{
+	(void)snprintf(buf, size, "IMG:%s/%d.ppm\tImage %d.%d\tWith a picture\n",
+	               imgdir, i % NIMAGES, round, i);
+}
+
+static void
+mklong(char *buf, size_t size, int round, int i)
+{
+	static const char text[] = "The quick brown fox jumps over the lazy dog. ";
+	size_t n, k;
+
+	n = snprintf(buf, size, "Long %d.%d\t", round, i);
+	for (k = 0; n + 2 < size && k < LONGBODY; n++, k++)
+		buf[n] = text[k % (sizeof(text) - 1)];
+	buf[n++] = '\n';
+	buf[n] = '\0';
+}
+
+static void
+mkunicode(char *buf, size_t size, int round, int i)
+{
+	/* scripts that usually need fallback fonts */
+	(void)snprintf(buf, size,
+	               "Unicode %d.%d\t"
+	               "日本語のテキスト 中文文本 한국어 텍스트\t"
+	               "النص العربي עברית ελληνικά русский\t"
+	               "\xe2\x9c\x93 \xe2\x98\x85 \xe2\x86\x92 \xe2\x88\x9e \xf0\x9f\x94\x94\n",
+	               round, i);
+}
+
+static int
+cmplonglong(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+runworkload(const struct Workload *w, int fd, pid_t pid)
+{
+	static char line[LONGBODY + 256];
+	long long *samples, t0, elapsed = 0;
+	unsigned long req0, nreqs = 0;
+	size_t nsamples = 0, nnotifs = 0;
+	int round, i;
+
+	if ((samples = calloc((size_t)w->nrounds * MAXWINS, sizeof(*samples))) == NULL)
+		err(1, "calloc");
+	for (round = 0; round < w->nrounds; round++) {
+		req0 = getrequests();
+		nmaptimes = 0;
+		t0 = getusec();
+		for (i = 0; i < w->nlines; i++) {
+			w->mkline(line, sizeof(line), round, i);
+			if (writeall(fd, line, strlen(line)) == -1)
+				err(1, "write");
+		}
+		while (nmaptimes < w->nmaps && pump(QUIET) > 0)
+			;
+		if (nmaptimes < w->nmaps)
+			warnx("%s: %d of %d windows mapped", w->name, nmaptimes, w->nmaps);
+		for (i = 0; i < nmaptimes; i++)
+			samples[nsamples++] = maptimes[i] - t0;
+		if (nmaptimes > 0)
+			elapsed += maptimes[nmaptimes - 1] - t0;
+		nnotifs += w->nlines;
+		clearscreen(pid);
+		nreqs += getrequests() - req0;
+	}
+	qsort(samples, nsamples, sizeof(*samples), cmplonglong);
+	printf("%-10s %8zu %10.2f %10.2f %12.0f %10.1f %10ld\n",
+	       w->name,
+	       nnotifs,
+	       nsamples ? samples[nsamples / 2] / 1000.0 : 0.0,
+	       nsamples ? samples[nsamples * 99 / 100] / 1000.0 : 0.0,
+	       elapsed ? nnotifs * 1e6 / elapsed : 0.0,
+	       (double)nreqs / nnotifs,
+	       getrss(pid));
+	fflush(stdout);
+	free(samples);
+}
+
+static void
+usage(void)
+{
+	(void)fprintf(stderr, "usage: xbench [-d display] [-p display] [-r rounds] xnotify [args ...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct Workload workloads[] = {
+		{ "single",   100, 1,  1,  mksingle   },
+		{ "burst",    20,  16, 16, mkburst    },
+		{ "tagchurn", 20,  16, 1,  mktagchurn },
+		{ "image",    20,  4,  4,  mkimage    },
+		{ "long",     20,  4,  4,  mklong     },
+		{ "unicode",  20,  4,  4,  mkunicode  },
+	};
+	char dpyname[32], proxyname[32];
+	const char *display = NULL;
+	int ch, fds[2], status, rounds = 0;
+	int dpynum, proxynum = -1;
+	size_t i;
+	pid_t pid;
+
+	while ((ch = getopt(argc, argv, "d:p:r:")) != -1) {
+		switch (ch) {
+		case 'd':
+			display = optarg;
+			break;
+		case 'p':
+			proxynum = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0)
+		usage();
+	if (display == NULL && (display = getenv("DISPLAY")) == NULL)
+		errx(1, "no display");
+	if (sscanf(display, ":%d", &dpynum) != 1)
+		errx(1, "%s: display must be local, like :99", display);
+	if (proxynum == -1)
+		proxynum = dpynum + 1;
+	(void)snprintf(dpyname, sizeof(dpyname), ":%d", dpynum);
+	(void)snprintf(proxyname, sizeof(proxyname), "127.0.0.1:%d", proxynum);
+
+	if ((dpy = XOpenDisplay(dpyname)) == NULL)
+		errx(1, "could not open display %s", dpyname);
+	XSelectInput(dpy, DefaultRootWindow(dpy), SubstructureNotifyMask);
+	XSync(dpy, False);
+	initproxy(dpynum, proxynum);
+	mkimages();
+
+	/* run xnotify on the proxy, reading from a pipe */
+	signal(SIGPIPE, SIG_IGN);
+	if (pipe(fds) == -1)
+		err(1, "pipe");
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		close(fds[1]);
+		if (dup2(fds[0], STDIN_FILENO) == -1)
+			err(1, "dup2");
+		close(fds[0]);
+		if (setenv("DISPLAY", proxyname, 1) == -1)
+			err(1, "setenv");
+		execvp(argv[0], argv);
+		err(1, "%s", argv[0]);
+	}
+	close(fds[0]);
+
+	/* wait for xnotify to set itself up */
+	while (getrequests() == 0) {
+		if (waitpid(pid, &status, WNOHANG) == pid)
+			errx(1, "%s exited", argv[0]);
+		(void)pump(SETTLE);
+	}
+	settle();
+
+	printf("%-10s %8s %10s %10s %12s %10s %10s\n",
+	       "workload", "notifs", "p50 ms", "p99 ms", "notifs/s", "reqs/notif", "rss KB");
+	for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		if (rounds > 0)
+			workloads[i].nrounds = rounds;
+		runworkload(&workloads[i], fds[1], pid);
+	}
+
+	/* xnotify exits at the end of its input, once no notification is left */
+	close(fds[1]);
+	for (i = 0; waitpid(pid, &status, WNOHANG) == 0; i++) {
+		if (i == 50)
+			(void)kill(pid, SIGTERM);
+		(void)pump(100);
+	}
+	rmimages();
+	XCloseDisplay(dpy);
+	return 0;
+}
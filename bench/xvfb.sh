@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Run a benchmark on a private Xvfb server.
+# usage: xvfb.sh command [args ...]
+#
+# The display of the server is taken from $XBENCH_DISPLAY (default :99)
+# and passed to the command in $DISPLAY.
+
+display="${XBENCH_DISPLAY:-:99}"
+num="${display#:}"
+
+if [ -e "/tmp/.X11-unix/X$num" ]; then
+	echo "xvfb.sh: display $display is in use" >&2
+	exit 1
+fi
+Xvfb "$display" -screen 0 1280x1024x24 -nolisten tcp >/dev/null 2>&1 &
+xvfb=$!
+trap 'kill "$xvfb" 2>/dev/null; wait "$xvfb" 2>/dev/null' EXIT
+trap 'exit 1' INT TERM
+
+tries=0
+while [ ! -S "/tmp/.X11-unix/X$num" ]; do
+	tries=$((tries + 1))
+	if [ "$tries" -gt 50 ] || ! kill -0 "$xvfb" 2>/dev/null; then
+		echo "xvfb.sh: could not start Xvfb on $display" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+DISPLAY="$display" "$@"
@@ -10,25 +10,78 @@
 
 #include "ctrlfnt.h"
 
+#define MAXGLYPHS   1024
+#define WIDTHMAXLEN 128         /* longest string in the width cache */
+#define NBMP        0x10000     /* number of codepoints in the BMP */
+#define MAXCACHED   0xFE        /* maximum font index in the glyph cache */
+#define NOFONT      0xFF        /* cached index of codepoints with no font */
+#define BETWEEN(x, a, b)    ((a) <= (x) && (x) <= (b))
+
 struct VArray {
 	XftFont       **fonts;
 	size_t          capacity;
 	size_t          nmemb;
 };
 
+struct GlyphEntry {
+	FcChar32        glyph;
+	unsigned char   index;
+	unsigned char   nfonts;         /* number of fonts tried, for NOFONT */
+};
+
+/*
+ * Cache from codepoint to the index (plus one) of the font in xft_fontset
+ * that renders it; a zero index means that the codepoint was not looked
+ * up yet.  Codepoints in the Basic Multilingual Plane go into a flat
+ * table; the others go into an open-addressing hash table.
+ *
+ * Codepoints that no font covers and for which fontconfig found no
+ * usable fallback are cached as NOFONT; their hash table entry (for any
+ * plane) also records how many fonts of xft_fontset were tried, so only
+ * fonts loaded afterwards are tried again, and fontconfig is not.
+ */
+struct GlyphCache {
+	unsigned char  *bmp;
+	struct GlyphEntry *table;
+	size_t          capacity;
+	size_t          nmemb;
+};
+
+struct WidthEntry {
+	struct WidthEntry *prev, *next; /* least recently used list */
+	struct WidthEntry *chain;       /* next entry in the same bucket */
+	unsigned long   hash;
+	int             nbytes;
+	int             width;
+	char            text[WIDTHMAXLEN];
+};
+
+/*
+ * Bounded least-recently-used cache from strings to their widths.
+ * Entries are preallocated; the most recently used entry is at the
+ * head of the list, and the tail is recycled when the cache is full.
+ */
+struct WidthCache {
+	struct WidthEntry *entries;
+	struct WidthEntry **buckets;
+	struct WidthEntry *head, *tail;
+	size_t          capacity;       /* also the number of buckets */
+	size_t          nmemb;
+};
+
 struct CtrlFontSet {
 	Display        *display;
 	int             screen;
 	Visual         *visual;
 	Colormap        colormap;
 	struct VArray  *xft_fontset;
+	struct GlyphCache glyphcache;
+	struct WidthCache widthcache;
+	CtrlFontStats   stats;
 	XFontSet        xlfd_fontset;
 	XFontStruct    *xlfd_font;
 };
 
-#define MAXGLYPHS 1024
-#define BETWEEN(x, a, b)    ((a) <= (x) && (x) <= (b))
-
 static XftFont *
 openxftfont(Display *display, const char *fontname, double fontsize)
 {
@@ -213,14 +266,110 @@ getnextutf8char(const char *s, const char **next_ret)
 	return ucode;
 }
 
-static XftFont *
+static void
+clearwidthcache(struct WidthCache *cache)
+{
+	size_t i;
+
+	cache->head = cache->tail = NULL;
+	cache->nmemb = 0;
+	for (i = 0; i < cache->capacity; i++) {
+		cache->buckets[i] = NULL;
+	}
+}
+
+static unsigned long
+hashstring(const char *text, int nbytes)
+{
+	unsigned long hash = 2166136261UL;
+	int i;
+
+	/* FNV-1a */
+	for (i = 0; i < nbytes; i++) {
+		hash ^= (unsigned char)text[i];
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+static void
+unlinkwidthentry(struct WidthCache *cache, struct WidthEntry *entry)
+{
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		cache->head = entry->next;
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		cache->tail = entry->prev;
+}
+
+static void
+pushwidthentry(struct WidthCache *cache, struct WidthEntry *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if (cache->head != NULL)
+		cache->head->prev = entry;
+	else
+		cache->tail = entry;
+	cache->head = entry;
+}
+
+static struct WidthEntry *
+getwidthentry(struct WidthCache *cache, unsigned long hash,
+              const char *text, int nbytes)
+{
+	struct WidthEntry *entry;
+
+	for (entry = cache->buckets[hash % cache->capacity]; entry != NULL; entry = entry->chain) {
+		if (entry->hash == hash && entry->nbytes == nbytes &&
+		    memcmp(entry->text, text, nbytes) == 0) {
+			unlinkwidthentry(cache, entry);
+			pushwidthentry(cache, entry);
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void
+addwidthentry(struct WidthCache *cache, unsigned long hash,
+              const char *text, int nbytes, int width)
+{
+	struct WidthEntry *entry, **p;
+
+	if (cache->nmemb < cache->capacity) {
+		entry = &cache->entries[cache->nmemb++];
+	} else {
+		/* recycle the least recently used entry */
+		entry = cache->tail;
+		unlinkwidthentry(cache, entry);
+		p = &cache->buckets[entry->hash % cache->capacity];
+		while (*p != entry)
+			p = &(*p)->chain;
+		*p = entry->chain;
+	}
+	entry->hash = hash;
+	entry->nbytes = nbytes;
+	entry->width = width;
+	memcpy(entry->text, text, nbytes);
+	p = &cache->buckets[hash % cache->capacity];
+	entry->chain = *p;
+	*p = entry;
+	pushwidthentry(cache, entry);
+}
+
+static size_t
 opennewfont(CtrlFontSet *fontset, FcChar32 glyph)
 {
-	XftFont *retfont = fontset->xft_fontset->fonts[0];
+	size_t retindex = 0;
 #ifndef CTRLFNT_NO_SEARCH
 	FcCharSet *fccharset = NULL;
 	FcPattern *fcpattern = NULL;
 	FcPattern *match = NULL;
+	FcCharSet *matchset;
 	XftFont *font = NULL;
 	XftResult result;
 
@@ -235,15 +384,24 @@ opennewfont(CtrlFontSet *fontset, FcChar32 glyph)
 	if (!FcConfigSubstitute(NULL, fcpattern, FcMatchPattern))
 		goto done;
 	FcDefaultSubstitute(fcpattern);
+	fontset->stats.font_matches++;
 	if ((match = XftFontMatch(fontset->display, fontset->screen, fcpattern, &result)) == NULL)
 		goto done;
+	/* do not bother opening a font that does not cover the glyph */
+	if (FcPatternGetCharSet(match, FC_CHARSET, 0, &matchset) == FcResultMatch &&
+	    !FcCharSetHasChar(matchset, glyph))
+		goto done;
 	if ((font = XftFontOpenPattern(fontset->display, match)) == NULL)
 		goto done;
+	fontset->stats.fallback_opens++;
+	fontset->stats.char_lookups++;
 	if (XftCharExists(fontset->display, font, glyph) == FcFalse)
 		goto done;
 	if (addxftfont(fontset->xft_fontset, font) == -1)
 		goto done;
-	retfont = font;
+	/* cached widths may have been measured with a glyph now covered */
+	clearwidthcache(&fontset->widthcache);
+	retindex = fontset->xft_fontset->nmemb - 1;
 	font = NULL;
 done:
 	if (fccharset != NULL)
@@ -256,27 +414,139 @@ done:
 		XftFontClose(fontset->display, font);
 #endif /* CTRLFNT_NO_SEARCH */
 	(void)glyph;
-	return retfont;
+	return retindex;
 }
 
-static XftFont *
-getfontforglyph(CtrlFontSet *fontset, FcChar32 glyph)
+static struct GlyphEntry *
+getglyphentry(struct GlyphEntry *table, size_t capacity, FcChar32 glyph)
+{
+	size_t i;
+
+	/* capacity is a power of two, and the table is never full */
+	i = (glyph * 2654435761U) & (capacity - 1);
+	while (table[i].index != 0 && table[i].glyph != glyph)
+		i = (i + 1) & (capacity - 1);
+	return &table[i];
+}
+
+static unsigned char
+getcachedindex(struct GlyphCache *cache, FcChar32 glyph)
+{
+	if (glyph < NBMP)
+		return cache->bmp != NULL ? cache->bmp[glyph] : 0;
+	if (cache->table == NULL)
+		return 0;
+	return getglyphentry(cache->table, cache->capacity, glyph)->index;
+}
+
+static struct GlyphEntry *
+addglyphentry(struct GlyphCache *cache, FcChar32 glyph)
+{
+	struct GlyphEntry *table, *entry;
+	size_t capacity, i;
+
+	if ((cache->nmemb + 1) * 2 > cache->capacity) {
+		/* keep the load factor below one half */
+		capacity = cache->capacity == 0 ? 64 : cache->capacity * 2;
+		if ((table = calloc(capacity, sizeof(*table))) == NULL)
+			return NULL;
+		for (i = 0; i < cache->capacity; i++) {
+			if (cache->table[i].index == 0)
+				continue;
+			entry = getglyphentry(table, capacity, cache->table[i].glyph);
+			*entry = cache->table[i];
+		}
+		free(cache->table);
+		cache->table = table;
+		cache->capacity = capacity;
+	}
+	entry = getglyphentry(cache->table, cache->capacity, glyph);
+	if (entry->index == 0)
+		cache->nmemb++;
+	entry->glyph = glyph;
+	return entry;
+}
+
+static void
+setcachedindex(struct GlyphCache *cache, FcChar32 glyph, size_t index, size_t nfonts)
+{
+	struct GlyphEntry *entry;
+	unsigned char value;
+
+	/* index is either the index of a font or NOFONT */
+	if (index == NOFONT)
+		value = NOFONT;
+	else if (index < MAXCACHED)
+		value = index + 1;
+	else
+		return;
+	if (nfonts > MAXCACHED)
+		return;
+	if (glyph < NBMP) {
+		if (cache->bmp == NULL)
+			cache->bmp = calloc(NBMP, sizeof(*cache->bmp));
+		if (cache->bmp == NULL)
+			return;
+		cache->bmp[glyph] = value;
+		if (value != NOFONT) {
+			return;
+		}
+	}
+	if ((entry = addglyphentry(cache, glyph)) == NULL) {
+		if (glyph < NBMP)
+			cache->bmp[glyph] = 0;
+		return;
+	}
+	entry->index = value;
+	entry->nfonts = nfonts;
+}
+
+static size_t
+getfontindex(CtrlFontSet *fontset, FcChar32 glyph)
 {
+	struct GlyphCache *cache = &fontset->glyphcache;
+	size_t nfonts = fontset->xft_fontset->nmemb;
+	size_t first = 0;
 	size_t i;
 
-	for (i = 0; i < fontset->xft_fontset->nmemb; i++)
-		if (XftCharExists(fontset->display, fontset->xft_fontset->fonts[i], glyph) == FcTrue)
-			return fontset->xft_fontset->fonts[i];
-	return opennewfont(fontset, glyph);
+	switch (i = getcachedindex(cache, glyph)) {
+	case 0:
+		break;
+	case NOFONT:
+		/* only try the fonts loaded since the last failed search */
+		first = getglyphentry(cache->table, cache->capacity, glyph)->nfonts;
+		if (first == nfonts)
+			return 0;
+		break;
+	default:
+		return i - 1;
+	}
+	for (i = first; i < nfonts; i++) {
+		fontset->stats.char_lookups++;
+		if (XftCharExists(fontset->display, fontset->xft_fontset->fonts[i], glyph) == FcTrue) {
+			setcachedindex(cache, glyph, i, 0);
+			return i;
+		}
+	}
+	/* ask fontconfig for a fallback font only once per glyph */
+	if (first == 0 && (i = opennewfont(fontset, glyph)) != 0) {
+		setcachedindex(cache, glyph, i, 0);
+		return i;
+	}
+	/* no font covers the glyph; draw it with the first font */
+	if (first == 0)
+		fontset->stats.fallback_misses++;
+	setcachedindex(cache, glyph, NOFONT, fontset->xft_fontset->nmemb);
+	return 0;
 }
 
 static size_t
-getfontcoverage(CtrlFontSet *fontset, XftFont *font, FcChar32 *glyphs, size_t nglyphs)
+getfontcoverage(CtrlFontSet *fontset, size_t index, FcChar32 *glyphs, size_t nglyphs)
 {
 	size_t i;
 
 	for (i = 0; i < nglyphs; i++)
-		if (!XftCharExists(fontset->display, font, glyphs[i]))
+		if (getfontindex(fontset, glyphs[i]) != index)
 			return i;
 	return i;
 }
@@ -334,6 +604,7 @@ drawxftstring(CtrlFontSet *fontset, Picture picture, Picture src,
 	XftFont *font;
 	XGlyphInfo extents;
 	const char *end = text;
+	size_t index;
 	size_t nglyphs = 0;
 	size_t nwritten = 0;
 	size_t n = 0;
@@ -345,10 +616,11 @@ drawxftstring(CtrlFontSet *fontset, Picture picture, Picture src,
 	while (end < text + nbytes && end < text + MAXGLYPHS)
 		glyphs[nglyphs++] = getnextutf8char(end, &end);
 	while (nwritten < nglyphs) {
-		font = getfontforglyph(fontset, glyphs[nwritten]);
+		index = getfontindex(fontset, glyphs[nwritten]);
+		font = fontset->xft_fontset->fonts[index];
 		n = 1 + getfontcoverage(
 			fontset,
-			font,
+			index,
 			glyphs + nwritten + 1,
 			nglyphs - nwritten - 1
 		);
@@ -502,6 +774,7 @@ widthxftstring(CtrlFontSet *fontset, const char *text, int nbytes)
 	XftFont *font;
 	XGlyphInfo extents;
 	const char *end = text;
+	size_t index;
 	size_t nglyphs = 0;
 	size_t nwritten = 0;
 	size_t n = 0;
@@ -509,25 +782,28 @@ widthxftstring(CtrlFontSet *fontset, const char *text, int nbytes)
 
 	if (nbytes == 0)
 		return 0;
-	while (end < text + nbytes)
-		glyphs[nglyphs++] = getnextutf8char(end, &end);
-	while (nwritten < nglyphs) {
-		font = getfontforglyph(fontset, glyphs[nwritten]);
-		n = 1 + getfontcoverage(
-			fontset,
-			font,
-			glyphs + nwritten + 1,
-			nglyphs - nwritten - 1
-		);
-		XftTextExtents32(
-			fontset->display,
-			font,
-			glyphs + nwritten,
-			n,
-			&extents
-		);
-		nwritten += n;
-		width += extents.xOff;
+	while (end < text + nbytes) {
+		/* measure MAXGLYPHS glyphs at a time */
+		for (nglyphs = 0; end < text + nbytes && nglyphs < MAXGLYPHS; nglyphs++)
+			glyphs[nglyphs] = getnextutf8char(end, &end);
+		for (nwritten = 0; nwritten < nglyphs; nwritten += n) {
+			index = getfontindex(fontset, glyphs[nwritten]);
+			font = fontset->xft_fontset->fonts[index];
+			n = 1 + getfontcoverage(
+				fontset,
+				index,
+				glyphs + nwritten + 1,
+				nglyphs - nwritten - 1
+			);
+			XftTextExtents32(
+				fontset->display,
+				font,
+				glyphs + nwritten,
+				n,
+				&extents
+			);
+			width += extents.xOff;
+		}
 	}
 	return width;
 }
@@ -573,6 +849,21 @@ ctrlfnt_open(Display *display, int screen, Visual *visual, Colormap
 		.visual = visual,
 		.colormap = colormap,
 		.xft_fontset = NULL,
+		.glyphcache = {
+			.bmp = NULL,
+			.table = NULL,
+			.capacity = 0,
+			.nmemb = 0,
+		},
+		.widthcache = {
+			.entries = NULL,
+			.buckets = NULL,
+			.head = NULL,
+			.tail = NULL,
+			.capacity = 0,
+			.nmemb = 0,
+		},
+		.stats = { 0 },
 		.xlfd_fontset = NULL,
 		.xlfd_font = NULL,
 	};
@@ -630,11 +921,9 @@ ctrlfnt_draw(CtrlFontSet *fontset, Picture picture, Picture src,
 	return -1;
 }
 
-int
-ctrlfnt_width(CtrlFontSet *fontset, const char *text, int nbytes)
+static int
+getwidth(CtrlFontSet *fontset, const char *text, int nbytes)
 {
-	if (fontset == NULL)
-		return 0;
 	if (fontset->xft_fontset != NULL)
 		return widthxftstring(fontset, text, nbytes);
 	if (fontset->xlfd_fontset != NULL)
@@ -644,6 +933,66 @@ ctrlfnt_width(CtrlFontSet *fontset, const char *text, int nbytes)
 	return 0;
 }
 
+int
+ctrlfnt_width(CtrlFontSet *fontset, const char *text, int nbytes)
+{
+	struct WidthEntry *entry;
+	unsigned long hash;
+	int w;
+
+	if (fontset == NULL)
+		return 0;
+	if (fontset->widthcache.capacity == 0 || nbytes > WIDTHMAXLEN)
+		return getwidth(fontset, text, nbytes);
+	hash = hashstring(text, nbytes);
+	if ((entry = getwidthentry(&fontset->widthcache, hash, text, nbytes)) != NULL) {
+		fontset->stats.width_hits++;
+		return entry->width;
+	}
+	fontset->stats.width_misses++;
+	w = getwidth(fontset, text, nbytes);
+	addwidthentry(&fontset->widthcache, hash, text, nbytes, w);
+	return w;
+}
+
+int
+ctrlfnt_cache(CtrlFontSet *fontset, size_t nentries)
+{
+	struct WidthCache *cache;
+
+	if (fontset == NULL)
+		return -1;
+	cache = &fontset->widthcache;
+	free(cache->entries);
+	free(cache->buckets);
+	cache->entries = NULL;
+	cache->buckets = NULL;
+	cache->capacity = 0;
+	clearwidthcache(cache);
+	if (nentries == 0)
+		return 0;
+	cache->entries = calloc(nentries, sizeof(*cache->entries));
+	cache->buckets = calloc(nentries, sizeof(*cache->buckets));
+	if (cache->entries == NULL || cache->buckets == NULL) {
+		free(cache->entries);
+		free(cache->buckets);
+		cache->entries = NULL;
+		cache->buckets = NULL;
+		return -1;
+	}
+	cache->capacity = nentries;
+	return 0;
+}
+
+void
+ctrlfnt_stats(CtrlFontSet *fontset, CtrlFontStats *stats)
+{
+	if (fontset == NULL)
+		*stats = (CtrlFontStats){ 0 };
+	else
+		*stats = fontset->stats;
+}
+
 int
 ctrlfnt_height(CtrlFontSet *fontset)
 {
@@ -682,6 +1031,10 @@ ctrlfnt_free(CtrlFontSet *fontset)
 		free(fontset->xft_fontset->fonts);
 		free(fontset->xft_fontset);
 	}
+	free(fontset->glyphcache.bmp);
+	free(fontset->glyphcache.table);
+	free(fontset->widthcache.entries);
+	free(fontset->widthcache.buckets);
 	if (fontset->xlfd_fontset != NULL) {
 		XFreeFontSet(fontset->display, fontset->xlfd_fontset);
 	}
@@ -1,5 +1,14 @@
 typedef struct CtrlFontSet CtrlFontSet;
 
+typedef struct CtrlFontStats {
+	unsigned long   width_hits;
+	unsigned long   width_misses;
+	unsigned long   font_matches;
+	unsigned long   char_lookups;
+	unsigned long   fallback_opens;
+	unsigned long   fallback_misses;
+} CtrlFontStats;
+
 CtrlFontSet *
 ctrlfnt_open(
 	Display        *display,
@@ -22,6 +31,8 @@ ctrlfnt_draw(
 
 int ctrlfnt_width(CtrlFontSet *fontset, const char *text, int nbytes);
 int ctrlfnt_height(CtrlFontSet *fontset);
+int ctrlfnt_cache(CtrlFontSet *fontset, size_t nentries);
+void ctrlfnt_stats(CtrlFontSet *fontset, CtrlFontStats *stats);
 void ctrlfnt_free(CtrlFontSet *fontset);
 void ctrlfnt_init(void);
 void ctrlfnt_term(void);
@@ -0,0 +1,120 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "parse.h"
+
+#define ISSEP(c)    ((c) == '\t' || (c) == '\n')
+
+static const struct {
+	const char     *key;
+	size_t          len;
+} keys[PARSE_NOPTIONS] = {
+	[PARSE_IMG] = { "IMG:", 4 },
+	[PARSE_BG]  = { "BG:",  3 },
+	[PARSE_FG]  = { "FG:",  3 },
+	[PARSE_BRD] = { "BRD:", 4 },
+	[PARSE_TAG] = { "TAG:", 4 },
+	[PARSE_CMD] = { "CMD:", 4 },
+	[PARSE_SEC] = { "SEC:", 4 },
+	[PARSE_BAR] = { "BAR:", 4 },
+};
+
+static int
+matchkey(const char *s, size_t len, int option, size_t *keylen)
+{
+	if (len < keys[option].len || memcmp(s, keys[option].key, keys[option].len) != 0)
+		return -1;
+	*keylen = keys[option].len;
+	return option;
+}
+
+int
+parse_option(const char *s, size_t len, size_t *keylen)
+{
+	/*
+	 * Return the option whose key the field begins with, or -1.  The
+	 * first two letters select the only key the field can match, so
+	 * at most one key is compared, whatever the number of options.
+	 */
+	if (len < 3)
+		return -1;
+	switch (s[0]) {
+	case 'B':
+		if (s[1] == 'G')
+			return matchkey(s, len, PARSE_BG, keylen);
+		if (s[1] == 'R')
+			return matchkey(s, len, PARSE_BRD, keylen);
+		return matchkey(s, len, PARSE_BAR, keylen);
+	case 'C':
+		return matchkey(s, len, PARSE_CMD, keylen);
+	case 'F':
+		return matchkey(s, len, PARSE_FG, keylen);
+	case 'I':
+		return matchkey(s, len, PARSE_IMG, keylen);
+	case 'S':
+		return matchkey(s, len, PARSE_SEC, keylen);
+	case 'T':
+		return matchkey(s, len, PARSE_TAG, keylen);
+	default:
+		return -1;
+	}
+}
+
+int
+parse_field(const char *s, size_t len, size_t *pos, ParseSlice *field)
+{
+	size_t i;
+
+	/*
+	 * Get into field the next field at or after *pos, skipping tabs
+	 * and newlines, and advance *pos past it.  Return 0 if there is
+	 * no field left.  The string is not modified.
+	 */
+	for (i = *pos; i < len && ISSEP(s[i]); i++)
+		;
+	field->off = i;
+	for (; i < len && !ISSEP(s[i]); i++)
+		;
+	field->len = i - field->off;
+	*pos = i;
+	return field->len > 0;
+}
+
+int
+parse_spec(const char *s, size_t len, ParseSpec *spec)
+{
+	ParseSlice field;
+	size_t pos, keylen;
+	int option;
+
+	/*
+	 * Split a notification line, in a single pass over its bytes,
+	 * into the options at its beginning, its title (the first field
+	 * that is not an option) and its body (what follows the title).
+	 * The body is not split into lines here; see parse_field().
+	 * Return -1 if the notification has neither a title nor an image.
+	 */
+	spec->options = 0;
+	spec->title.off = spec->title.len = 0;
+	spec->body.off = spec->body.len = 0;
+	pos = 0;
+	while (parse_field(s, len, &pos, &field)) {
+		option = parse_option(s + field.off, field.len, &keylen);
+		if (option == -1) {
+			spec->title = field;
+			break;
+		}
+		spec->options |= 1U << option;
+		spec->option[option].off = field.off + keylen;
+		spec->option[option].len = field.len - keylen;
+	}
+	if (spec->title.len > 0) {
+		while (pos < len && ISSEP(s[pos]))
+			pos++;
+		spec->body.off = pos;
+		spec->body.len = len - pos;
+	}
+	if (spec->title.len == 0 && !(spec->options & (1U << PARSE_IMG)))
+		return -1;
+	return 0;
+}
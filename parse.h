@@ -0,0 +1,27 @@
+enum ParseOption {
+	PARSE_IMG,
+	PARSE_BG,
+	PARSE_FG,
+	PARSE_BRD,
+	PARSE_TAG,
+	PARSE_CMD,
+	PARSE_SEC,
+	PARSE_BAR,
+	PARSE_NOPTIONS
+};
+
+typedef struct ParseSlice {
+	size_t          off;
+	size_t          len;
+} ParseSlice;
+
+typedef struct ParseSpec {
+	unsigned int    options;                /* bitmask of the options given */
+	ParseSlice      option[PARSE_NOPTIONS]; /* values of the options given */
+	ParseSlice      title;
+	ParseSlice      body;                   /* rest of the line after the title */
+} ParseSpec;
+
+int parse_option(const char *s, size_t len, size_t *keylen);
+int parse_field(const char *s, size_t len, size_t *pos, ParseSlice *field);
+int parse_spec(const char *s, size_t len, ParseSpec *spec);
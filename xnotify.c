@@ -1,8 +1,10 @@
 #include <ctype.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -11,6 +13,10 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 #include <X11/Xresource.h>
@@ -18,15 +24,43 @@
 #include <X11/extensions/Xrender.h>
 #include <Imlib2.h>
 
+#ifdef USE_SDT
+#include <sys/sdt.h>
+#endif
+
 #include "ctrlfnt.h"
+#include "parse.h"
 
 #define APP_CLASS           "XNotify"
 #define APP_NAME            "xnotify"
 #define DEFWIDTH            350     /* default width of a notification */
-#define MAXLINES            128     /* maximum number of unwrapped lines */
+#define INPUTSIZ            8192    /* initial size of input buffer */
+#define INPUTBATCH          65536   /* maximum bytes read from input per batch */
+#define INPUTMAX            1048576 /* maximum length of an input line */
+#define POOLMAX             8       /* maximum number of idle backing pixmaps */
+#define POOLIDLE            30000   /* milliseconds before freeing idle pixmaps */
+#define MAXBUCKETS          256     /* maximum number of rate limiting buckets */
+#define MAXCLIENTS          64      /* maximum number of socket connections */
+#define FRAMEHDR            5       /* size of the header of a frame or a field */
+#define NHISTBUCKETS        12      /* number of finite buckets of a histogram */
+#define MAXLABEL            256     /* maximum length of a source or tag in the metrics */
+#define METRICSWAIT         100     /* milliseconds for a client to read the metrics */
 #define MIN(x,y)            ((x)<(y)?(x):(y))
 #define MAX(x,y)            ((x)>(y)?(x):(y))
 #define BETWEEN(x, a, b)    ((a) <= (x) && (x) <= (b))
+
+/*
+ * Static tracepoints along the lifecycle of a notification.  Built with
+ * -DUSE_SDT, they are USDT probes of the provider xnotify, which cost a
+ * nop until a tracer attaches to them; otherwise they are compiled out.
+ */
+#ifdef USE_SDT
+#define TRACE1(probe, a)        DTRACE_PROBE1(xnotify, probe, a)
+#define TRACE2(probe, a, b)     DTRACE_PROBE2(xnotify, probe, a, b)
+#else
+#define TRACE1(probe, a)
+#define TRACE2(probe, a, b)
+#endif
 #define RED(v)   ((((v) & 0xFF0000) >> 8) | (((v) & 0xFF0000) >> 16))
 #define GREEN(v) ((((v) & 0x00FF00)     ) | (((v) & 0x00FF00) >> 8))
 #define BLUE(v)  ((((v) & 0x0000FF) << 8) | (((v) & 0x0000FF)     ))
@@ -47,27 +81,54 @@
 	X(RES_BORDERWID,  "BorderWidth",        "borderWidth",          1               )\
 	X(RES_FACENAME,   "FaceName",           "faceName",             0               )\
 	X(RES_FOREGROUND, "Foreground",         "foreground",           0xFFFFFF        )\
+	X(RES_FRAMETIME,  "FrameTime",          "frameTime",            16              )\
 	X(RES_GAP,        "Gap",                "gap",                  7               )\
 	X(RES_GEOMETRY,   "Geometry",           "geometry",             0               )\
 	X(RES_GRAVITY,    "Gravity",            "gravity",              NorthEastGravity)\
+	X(RES_IMAGECACHE, "ImageCache",         "imageCache",           4096            )\
 	X(RES_IMAGEWID,   "ImageWidth",         "imageWidth",           80              )\
 	X(RES_LEADING,    "Leading",            "leading",              5               )\
 	X(RES_MAXHEIGHT,  "MaxHeight",          "maxHeight",            300             )\
+	X(RES_MAXITEMS,   "MaxNotifications",   "maxNotifications",     32              )\
 	X(RES_OPACITY,    "Opacity",            "opacity",              0xFFFF          )\
+	X(RES_OVERFLOW,   "Overflow",           "overflow",             DropOldest      )\
 	X(RES_PADDING,    "Padding",            "padding",              10              )\
 	X(RES_SHRINK,     "Shrink",             "shrink",               0               )\
-
-enum ItemOption {IMG, BG, FG, BRD, TAG, CMD, SEC, BAR, UNKNOWN};
+	X(RES_SRCBURST,   "SourceBurst",        "sourceBurst",          10              )\
+	X(RES_SRCRATE,    "SourceRate",         "sourceRate",           0               )\
+	X(RES_TAGBURST,   "TagBurst",           "tagBurst",             10              )\
+	X(RES_TAGRATE,    "TagRate",            "tagRate",              0               )\
+	X(RES_WIDTHCACHE, "WidthCache",         "widthCache",           512             )\
+	X(RES_WINPOOL,    "WindowPool",         "windowPool",           4               )\
+	X(RES_WINPOOLMAX, "WindowPoolMax",      "windowPoolMax",        16              )\
+
+/* types of the fields of a framed notification, see parseframe() */
+enum {
+	FIELD_TITLE     = 'T',
+	FIELD_BODY      = 'B',
+	FIELD_IMG       = 'I',
+	FIELD_BG        = 'b',
+	FIELD_FG        = 'f',
+	FIELD_BRD       = 'r',
+	FIELD_TAG       = 'g',
+	FIELD_CMD       = 'c',
+	FIELD_TIME      = 's',
+	FIELD_BAR       = 'p',
+};
 
 enum {DownWards, UpWards};
 
 enum {LeftAlignment, CenterAlignment, RightAlignment};
 
+/* what to do with a notification that does not fit in a full queue */
+enum {DropOldest, DropNewest, DropSummary, NOVERFLOWS};
+
 enum {
 	SIGNAL_NONE    = 0,
 	SIGNAL_KILL    = 1,
 	SIGNAL_CMD     = 2,
 	SIGNAL_KILLALL = 3,
+	SIGNAL_DUMP    = 4,
 };
 
 enum Atom {
@@ -95,44 +156,169 @@ struct Monitor {
 	int x, y, w, h;
 };
 
-/* notification item specification structure */
+/* notification item specification, pointing into the input it was read from */
 struct Itemspec {
-	char *firstline;
-	char *otherlines;
-	char *file;
-	char *background;
-	char *foreground;
-	char *border;
-	char *tag;
-	char *cmd;
+	const char *buf;        /* what the slices are offsets into */
+	ParseSpec spec;         /* options and title; the body is in lines */
+	ParseSlice *lines;      /* non-empty lines of the body */
+	size_t nlines;
+	size_t maxlines;        /* allocated size of lines */
 	int bar;
-	int sec;
+	int msec;
+};
+
+/* decoded image, scaled to fit into a square box */
+struct Image {
+	struct Image *prev, *next;      /* least recently used list */
+	char *path;
+	time_t mtime;                   /* modification time of the file */
+	off_t size;                     /* size of the file */
+	int box;                        /* size of the box it was scaled to */
+	int w, h;                       /* size of the scaled image */
+	unsigned int *pixels;           /* premultiplied ARGB, until uploaded */
+	Pixmap pixmap;                  /* the image in the server */
+	Picture picture;
+	int refcount;                   /* number of notifications showing it */
+};
+
+/* cache of decoded images */
+struct ImageCache {
+	struct Image *head, *tail;      /* from most to least recently used */
+	size_t nbytes;                  /* memory used by the cached images */
+	size_t maxbytes;
+	unsigned long hits, misses;
+};
+
+/* request to decode an image, handled by the decoder thread */
+struct Job {
+	struct Job *next;
+	char *path;
+	time_t mtime;
+	off_t size;
+	int box;
+	struct Image *image;            /* the result, NULL on error */
+	long long usec;                 /* time taken to decode it */
+};
+
+/*
+ * Image decoding requests, shared with the decoder thread.  Imlib2 is
+ * not thread safe, so there is a single decoder, the only user of
+ * Imlib2 once set up.
+ */
+struct Jobs {
+	pthread_mutex_t mutex;          /* protects everything but the thread */
+	pthread_cond_t cond;            /* signaled when a job is requested */
+	struct Job *todo, *todotail;    /* requested jobs */
+	struct Job *done;               /* finished jobs */
+	bool quit;
+	int pipefd[2];                  /* written to when a job is finished */
+	pthread_t thread;
+};
+
+/* line of text of a notification */
+struct Slice {
+	size_t off;     /* offset into the text of the item */
+	size_t len;
+};
+
+/* wrapped line of text, as laid out in a notification */
+struct Run {
+	const char *text;
+	size_t len;
+	int x, y;
+};
+
+/* backing pixmap of a notification window */
+struct Backing {
+	struct Backing *next;
+	Pixmap pixmap;
+	Picture picture;
+	int w, h;
+	int depth;
+	long long idle;         /* when it was returned to the pool */
+};
+
+/* unmapped notification windows ready to be reused */
+struct WindowPool {
+	Window *wins;
+	int nwins;
+	int max;        /* high-water mark */
 };
 
 /* notification item structure */
 struct Item {
 	struct Item *prev, *next;
+	struct Item *winchain;  /* next item in the same bucket of the window index */
+	struct Item *tagchain;  /* next item in the same bucket of the tag index */
 
+	/*
+	 * The item is allocated in a single block, along with its runs,
+	 * its lines, and the nul-terminated strings they point into.
+	 */
 	int nlines;
-	char *line[MAXLINES];
+	struct Slice *lines;    /* lines of text, in text */
+	char *text;             /* strings of the item, after the lines */
 	char *tag;
 	char *cmd;
 
-	time_t time;
-	int sec;
+	/* content of the item, see newitem() */
+	char *key;
+	size_t keylen;
+	unsigned long hash;
+	unsigned long ndups;    /* number of notifications coalesced into the item */
+	struct Item *dupchain;  /* next item in the same bucket of the content index */
+
+	long long received;     /* when it was read, in microseconds; 0 if never */
+	long long deadline;     /* when the item expires, in milliseconds */
+	int msec;               /* lifetime of the item; 0 for no expiration */
+	size_t heapidx;         /* position in the timer heap */
+
+	unsigned long id;       /* rank of the notification among those read */
+	unsigned long seq;      /* position in the queue, increasing from head to tail */
+	int offset;             /* sum of the heights of the previous items */
+	int x, y;               /* current position */
+	bool mapped;
 
 	int w, h;
 	int imgw;
 	int textw;
+	int badgew;             /* width kept free for the badge on the first run */
 
 	int bar;
 
+	/* layout, computed by layoutitem() */
+	struct Run *runs;
+	int nruns;
+	int maxruns;            /* number of runs that fit in max_height */
+	XRectangle imgbox;      /* position and size of the scaled image */
+	XRectangle barbox;      /* position and size of the progress bar */
+
 	XRenderColor background;
 	XRenderColor foreground;
 	XRenderColor borderclr;
 
-	Imlib_Image image;
+	char *file;             /* path of the image file */
+	struct Image *image;
+	bool loading;           /* whether the image is being decoded */
+	int loadbox;            /* size of the box it is being scaled to */
 	Window win;
+	struct Backing *backing;
+};
+
+/* hash tables indexing notification items by window, by tag and by content */
+struct Index {
+	struct Item **winbuckets;
+	struct Item **tagbuckets;
+	struct Item **dupbuckets;
+	size_t nbuckets;        /* a power of two */
+	size_t nitems;
+};
+
+/* min-heap of items with a lifetime, ordered by deadline */
+struct Timers {
+	struct Item **items;
+	size_t nitems;
+	size_t capacity;
 };
 
 /* notification queue structure */
@@ -144,8 +330,86 @@ struct Queue {
 	int x, y;       /* position of the first notification */
 	int w, h;       /* width and height of individual notifications */
 
-	/* whether the queue changed */
-	bool change;
+	/* first item whose position may have changed, NULL if none */
+	struct Item *dirty;
+	unsigned long seq;      /* sequence number of the next item */
+
+	/* bound on the number of notifications, see makeroom() */
+	size_t nitems;          /* number of items, not counting the summary */
+	size_t max;             /* maximum number of items, 0 for no limit */
+	int overflow;           /* DropOldest, DropNewest or DropSummary */
+	struct Item *summary;   /* "+N more" item, NULL if none */
+	unsigned long nmore;    /* number of items collapsed into the summary */
+	unsigned long dropped[NOVERFLOWS];      /* items dropped by each policy */
+};
+
+/* token bucket limiting the rate of notifications of a tag or a source */
+struct Bucket {
+	struct Bucket *next;    /* next bucket in the same hash chain */
+	int kind;               /* 's' for a source, 't' for a tag */
+	char *name;
+	double tokens;
+	long long last;         /* when the bucket was last refilled, in milliseconds */
+	unsigned long passed;   /* notifications let through */
+	unsigned long limited;  /* notifications dropped or summarized */
+};
+
+/* rate limits of notifications, in notifications per minute */
+struct Limits {
+	struct Bucket *buckets[MAXBUCKETS];
+	int nbuckets;
+	int tagrate, tagburst;
+	int srcrate, srcburst;
+};
+
+/* notifications collected during the current frame, not yet realized */
+struct Frame {
+	struct Item *head, *tail;       /* linked by their next pointer */
+	size_t npending;
+	unsigned long nmore;    /* pending items collapsed into the summary */
+	long long deadline;     /* when the frame is realized, in milliseconds */
+};
+
+/* buffered input structure */
+struct Input {
+	int fd;
+	char *buf;
+	size_t size;    /* allocated size of buf */
+	size_t beg;     /* position of first unparsed byte */
+	size_t end;     /* position after last read byte */
+	size_t skip;    /* bytes left of a frame too long to be read */
+	char source[32];        /* source of a socket connection, see clientsource() */
+};
+
+/* listening socket and its connections, each one with its own buffer */
+struct Server {
+	int fd;                 /* -1 if not listening */
+	const char *path;
+	struct Input clients[MAXCLIENTS];
+	int nclients;
+};
+
+/* distribution of durations, in the buckets bounded by histbounds */
+struct Histogram {
+	unsigned long counts[NHISTBUCKETS + 1]; /* the last bucket is +Inf */
+	unsigned long count;
+	double sum;             /* in seconds */
+};
+
+/* counters and histograms, written in Prometheus text format */
+struct Metrics {
+	unsigned long received;         /* lines and frames read */
+	unsigned long malformed;        /* lines and frames that could not be parsed */
+	unsigned long ratelimited;
+	unsigned long coalesced;
+	unsigned long created, expired, clicked;
+	struct Histogram latency;       /* from reading a notification to mapping it */
+	struct Histogram draw;          /* drawitem() */
+	struct Histogram decode;        /* decodeimage() */
+
+	int fd;                 /* socket the metrics are served on; -1 if none */
+	const char *path;
+	const char *dumppath;   /* file the metrics are dumped into on SIGQUIT */
 };
 
 /* ellipsis size and font structure */
@@ -157,7 +421,7 @@ struct Ellipsis {
 
 /* X stuff */
 static int alignment;
-static int seconds = 10;
+static int lifetime = 10000;    /* default lifetime in milliseconds */
 static int saveargc;
 static char **saveargv;
 static Display *dpy;
@@ -168,6 +432,21 @@ static int screen;
 static int depth;
 static int xfd;
 static struct Queue queue;      /* queue of notifications and their geometry */
+static struct Frame frame;      /* notifications waiting to be realized */
+static struct Itemspec parsed;  /* notification being ingested */
+static struct Backing *pool;    /* idle backing pixmaps, most recent first */
+static struct ImageCache images;
+static struct WindowPool winpool;
+static struct Index idx;        /* index of the items in the queue */
+static struct Timers timers;    /* expiration of the items in the queue */
+static struct Jobs jobs;        /* image decoding requests */
+static struct Limits limits;    /* rate limits per tag and per source */
+static struct Server server = { .fd = -1 };
+static struct Metrics metrics = { .fd = -1 };
+static const double histbounds[NHISTBUCKETS] = {        /* in seconds */
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+	0.01, 0.025, 0.05, 0.1, 0.25, 1.0,
+};
 static struct Monitor mon;
 static Atom atoms[NATOMS];
 static Resource application, resources[NRESOURCES];
@@ -180,6 +459,11 @@ static int gravity;    /* NorthEastGravity, NorthGravity, etc */
 static int direction;  /* DownWards or UpWards */
 static int gap_pixels, border_pixels, leading_pixels, padding_pixels;
 static int max_height, image_pixels;
+static int maxitems;
+static int frame_msec;
+static int imagecache_size;
+static int widthcache_size;
+static int winpool_size;
 static unsigned short opacity;
 static bool shrink;
 static unsigned int actionbutton = Button3;
@@ -193,8 +477,8 @@ volatile sig_atomic_t sigflag;
 void
 usage(void)
 {
-	(void)fprintf(stderr, "usage: xnotify [-ow] [-G gravity] [-b button] [-g geometry]\n");
-	(void)fprintf(stderr, "               [-h height] [-m monitor] [-s seconds]\n");
+	(void)fprintf(stderr, "usage: xnotify [-ow] [-D file] [-G gravity] [-b button] [-g geometry]\n");
+	(void)fprintf(stderr, "               [-h height] [-M socket] [-m monitor] [-S socket] [-s seconds]\n");
 	exit(1);
 }
 
@@ -208,6 +492,36 @@ emalloc(size_t size)
 	return p;
 }
 
+static void *
+ecalloc(size_t nmemb, size_t size)
+{
+	void *p;
+
+	if ((p = calloc(nmemb, size)) == NULL)
+		err(1, "calloc");
+	return p;
+}
+
+static void *
+erealloc(void *ptr, size_t size)
+{
+	void *p;
+
+	if ((p = realloc(ptr, size)) == NULL)
+		err(1, "realloc");
+	return p;
+}
+
+static char *
+estrdup(const char *s)
+{
+	char *t;
+
+	if ((t = strdup(s)) == NULL)
+		err(1, "strdup");
+	return t;
+}
+
 static char *
 gettextprop(Window window, Atom prop)
 {
@@ -279,17 +593,44 @@ parsegravityspec(int *gravity, int *direction, const char *gravityspec)
 	}
 }
 
+static int
+getduration(const char *s, int *msec)
+{
+	double d;
+	char *endp;
+
+	/* parse seconds (maybe fractional), or milliseconds if suffixed by "ms" */
+	d = strtod(s, &endp);
+	if (endp == s || !(d >= 0.0))
+		return 1;
+	if (strncmp(endp, "ms", 2) != 0)
+		d *= 1000.0;
+	if (d > INT_MAX)
+		return 1;
+	*msec = (int)(d + 0.5);
+	return 0;
+}
+
 static void
 parseoptions(int argc, char *argv[], const char **geomspec)
 {
 	unsigned long n;
-	int ch;
+	int ch, msec;
 
-	while ((ch = getopt(argc, argv, "G:b:g:h:m:ors:w")) != -1) {
+	while ((ch = getopt(argc, argv, "D:G:M:S:b:g:h:m:ors:w")) != -1) {
 		switch (ch) {
+		case 'D':
+			metrics.dumppath = optarg;
+			break;
 		case 'G':
 			parsegravityspec(&gravity, &direction, optarg);
 			break;
+		case 'M':
+			metrics.path = optarg;
+			break;
+		case 'S':
+			server.path = optarg;
+			break;
 		case 'b':
 			if (*(optarg+1) != '\0')
 				break;
@@ -324,8 +665,10 @@ parseoptions(int argc, char *argv[], const char **geomspec)
 			rflag = true;
 			break;
 		case 's':
-			if ((n = strtoul(optarg, NULL, 10)) < INT_MAX)
-				seconds = n;
+			if (getduration(optarg, &msec))
+				warnx("%s: invalid duration", optarg);
+			else
+				lifetime = msec;
 			break;
 		case 'w':
 			wflag = 1;
@@ -371,6 +714,51 @@ getnum(const char **s, int *n)
 	return retval;
 }
 
+static long long
+getmsec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long
+getusec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+observe(struct Histogram *hist, long long usec)
+{
+	double sec;
+	int i;
+
+	sec = usec / 1e6;
+	for (i = 0; i < NHISTBUCKETS && sec > histbounds[i]; i++)
+		;
+	hist->counts[i]++;
+	hist->count++;
+	hist->sum += sec;
+}
+
+static int
+mintimeout(int a, int b)
+{
+	/* -1 is an infinite timeout for poll(2) */
+	if (a == -1)
+		return b;
+	if (b == -1)
+		return a;
+	return MIN(a, b);
+}
+
 static void
 sigusr1handler(int sig)
 {
@@ -392,6 +780,13 @@ sighuphandler(int sig)
 	sigflag = SIGNAL_KILLALL;
 }
 
+static void
+sigquithandler(int sig)
+{
+	(void)sig;
+	sigflag = SIGNAL_DUMP;
+}
+
 static void
 initsignal(void)
 {
@@ -414,6 +809,15 @@ initsignal(void)
 	sigemptyset(&sa.sa_mask);
 	if (sigaction(SIGHUP, &sa, NULL) == -1)
 		err(1, "sigaction");
+
+	/* SIGQUIT keeps its default action unless there is a file to dump into */
+	if (metrics.dumppath == NULL)
+		return;
+	sa.sa_handler = sigquithandler;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGQUIT, &sa, NULL) == -1)
+		err(1, "sigaction");
 }
 
 static void
@@ -465,7 +869,8 @@ setqueue(const char *geomspec)
 
 	queue.head = NULL;
 	queue.tail = NULL;
-	queue.change = false;
+	queue.dirty = NULL;
+	queue.seq = 0;
 	if (geomspec != NULL)
 		parsegeometry(&queue, geomspec);
 	minw = ellipsis.width + image_pixels + padding_pixels * 3 + 1;
@@ -473,17 +878,133 @@ setqueue(const char *geomspec)
 		queue.w = MAX(DEFWIDTH, minw);
 }
 
+static size_t
+hashwindow(Window win)
+{
+	return (size_t)(win * 2654435761UL);
+}
+
+static unsigned long
+hashkey(const char *key, size_t len)
+{
+	unsigned long hash = 2166136261UL;
+
+	/* FNV-1a */
+	while (len-- > 0) {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+static void
+linkindex(struct Item *item)
+{
+	size_t i;
+
+	i = hashwindow(item->win) & (idx.nbuckets - 1);
+	item->winchain = idx.winbuckets[i];
+	idx.winbuckets[i] = item;
+	if (item->tag == NULL) {
+		/* only untagged items are coalesced; tagged ones are replaced */
+		i = item->hash & (idx.nbuckets - 1);
+		item->dupchain = idx.dupbuckets[i];
+		idx.dupbuckets[i] = item;
+		return;
+	}
+	i = hashkey(item->tag, strlen(item->tag)) & (idx.nbuckets - 1);
+	item->tagchain = idx.tagbuckets[i];
+	idx.tagbuckets[i] = item;
+}
+
+static void
+indexitem(struct Item *item)
+{
+	struct Item *p;
+
+	/* keep at most one item per bucket on average */
+	if (idx.nitems + 1 > idx.nbuckets) {
+		free(idx.winbuckets);
+		free(idx.tagbuckets);
+		free(idx.dupbuckets);
+		idx.nbuckets = (idx.nbuckets == 0) ? 64 : idx.nbuckets * 2;
+		idx.winbuckets = ecalloc(idx.nbuckets, sizeof(*idx.winbuckets));
+		idx.tagbuckets = ecalloc(idx.nbuckets, sizeof(*idx.tagbuckets));
+		idx.dupbuckets = ecalloc(idx.nbuckets, sizeof(*idx.dupbuckets));
+		for (p = queue.head; p != NULL; p = p->next) {
+			if (p != item) {
+				linkindex(p);
+			}
+		}
+	}
+	linkindex(item);
+	idx.nitems++;
+}
+
+static void
+unindexitem(struct Item *item)
+{
+	struct Item **p;
+
+	p = &idx.winbuckets[hashwindow(item->win) & (idx.nbuckets - 1)];
+	while (*p != item)
+		p = &(*p)->winchain;
+	*p = item->winchain;
+	if (item->tag != NULL) {
+		p = &idx.tagbuckets[hashkey(item->tag, strlen(item->tag)) & (idx.nbuckets - 1)];
+		while (*p != item)
+			p = &(*p)->tagchain;
+		*p = item->tagchain;
+	} else {
+		p = &idx.dupbuckets[item->hash & (idx.nbuckets - 1)];
+		while (*p != item)
+			p = &(*p)->dupchain;
+		*p = item->dupchain;
+	}
+	idx.nitems--;
+}
+
+static void
+dirtyitem(struct Item *item)
+{
+	/* the position of item, and of the items after it, must be recomputed */
+	if (item != NULL && (queue.dirty == NULL || item->seq < queue.dirty->seq)) {
+		queue.dirty = item;
+	}
+}
+
 static struct Item *
 getitem(Window win)
 {
 	struct Item *item;
 
-	for (item = queue.head; item; item = item->next)
+	if (idx.nbuckets == 0)
+		return NULL;
+	item = idx.winbuckets[hashwindow(win) & (idx.nbuckets - 1)];
+	for (; item != NULL; item = item->winchain)
 		if (item->win == win)
 			return item;
 	return NULL;
 }
 
+static struct Item *
+getduplicate(const struct Item *pending)
+{
+	struct Item *item;
+
+	/* return the untagged item with the same content as pending, if any */
+	if (idx.nbuckets == 0)
+		return NULL;
+	item = idx.dupbuckets[pending->hash & (idx.nbuckets - 1)];
+	for (; item != NULL; item = item->dupchain)
+		if (item != queue.summary &&
+		    item->hash == pending->hash &&
+		    item->keylen == pending->keylen &&
+		    memcmp(item->key, pending->key, item->keylen) == 0)
+			return item;
+	return NULL;
+}
+
 static Imlib_Image
 loadimage(const char *file)
 {
@@ -534,191 +1055,704 @@ loadimage(const char *file)
 		warnx("could not load image (%s): %s", errstr, file);
 		return NULL;
 	}
-	imlib_context_set_image(image);
-	imlib_image_set_changes_on_disk();
 	return image;
 }
 
 static void
-createwindow(struct Item *item)
+unlinkimage(struct Image *image)
 {
-	item->win = XCreateWindow(
-		dpy, root,
-		0, 0,           /* placed at (0,0) for now; will be moved later */
-		item->w,
-		1,              /* sized with 1px for now; will be resized later */
-		0,
-		depth,
-		InputOutput,
-		visual,
-		CWOverrideRedirect | CWBackPixel | CWBorderPixel |
-		CWSaveUnder | CWEventMask | CWColormap,
-		&(XSetWindowAttributes){
-			.override_redirect = wflag ? False : True,
-			.background_pixel = 0,
-			.border_pixel =0,
-			.colormap = colormap,
-			.save_under = True,
-			.event_mask = ButtonPressMask | PointerMotionMask,
+	if (image->prev != NULL)
+		image->prev->next = image->next;
+	else
+		images.head = image->next;
+	if (image->next != NULL)
+		image->next->prev = image->prev;
+	else
+		images.tail = image->prev;
+}
+
+static void
+pushimage(struct Image *image)
+{
+	image->prev = NULL;
+	image->next = images.head;
+	if (images.head != NULL)
+		images.head->prev = image;
+	else
+		images.tail = image;
+	images.head = image;
+}
+
+static void
+freeimage(struct Image *image)
+{
+	unlinkimage(image);
+	images.nbytes -= (size_t)image->w * image->h * sizeof(*image->pixels);
+	if (image->picture != None)
+		XRenderFreePicture(dpy, image->picture);
+	if (image->pixmap != None)
+		XFreePixmap(dpy, image->pixmap);
+	free(image->pixels);
+	free(image->path);
+	free(image);
+}
+
+static void
+trimimages(void)
+{
+	struct Image *image, *prev;
+
+	/* evict least recently used images not being shown */
+	for (image = images.tail; image != NULL && images.nbytes > images.maxbytes; image = prev) {
+		prev = image->prev;
+		if (image->refcount == 0) {
+			freeimage(image);
 		}
-	);
-	XmbSetWMProperties(
-		dpy, item->win,
-		APP_CLASS,      /* title name */
-		APP_CLASS,      /* icon name */
-		saveargv,
-		saveargc,
-		NULL,
-		NULL,
-		&(XClassHint){
-			.res_class = APP_CLASS,
-			.res_name = APP_NAME,
+	}
+}
+
+static struct Image *
+decodeimage(const char *path, int box)
+{
+	struct Image *image;
+	Imlib_Image orig, scaled;
+	DATA32 *data;
+	unsigned int a, argb;
+	int origw, origh, w, h;
+	size_t i, n;
+	bool hasalpha;
+
+	TRACE2(load__start, path, box);
+	orig = loadimage(path);
+	TRACE2(load__done, path, orig != NULL);
+	if (orig == NULL)
+		return NULL;
+	imlib_context_set_image(orig);
+	origw = imlib_image_get_width();
+	origh = imlib_image_get_height();
+	if (origw > origh) {
+		w = box;
+		h = MAX((origh * box) / origw, 1);
+	} else {
+		w = MAX((origw * box) / origh, 1);
+		h = box;
+	}
+	scaled = imlib_create_cropped_scaled_image(0, 0, origw, origh, w, h);
+	imlib_free_image_and_decache();
+	if (scaled == NULL) {
+		warnx("could not scale image: %s", path);
+		return NULL;
+	}
+	imlib_context_set_image(scaled);
+	hasalpha = imlib_image_has_alpha();
+	data = imlib_image_get_data_for_reading_only();
+	image = emalloc(sizeof(*image));
+	n = (size_t)w * h;
+	image->pixels = emalloc(n * sizeof(*image->pixels));
+	for (i = 0; i < n; i++) {
+		/* XRender wants premultiplied alpha */
+		argb = data[i];
+		if (!hasalpha) {
+			image->pixels[i] = argb | 0xFF000000;
+			continue;
 		}
-	);
-	XChangeProperty(
-		dpy,
-		item->win,
-		atoms[_NET_WM_NAME],
-		atoms[UTF8_STRING],
-		8,
-		PropModeReplace,
-		(unsigned char *)APP_CLASS,
-		strlen(APP_CLASS)
-	);
-	XChangeProperty(
-		dpy,
-		item->win,
-		atoms[_NET_WM_WINDOW_TYPE],
-		XA_ATOM,
-		32,
-		PropModeReplace,
-		(unsigned char *)&atoms[_NET_WM_WINDOW_TYPE_NOTIFICATION],
-		1
-	);
-	XChangeProperty(
-		dpy,
-		item->win,
-		atoms[_NET_WM_STATE],
-		XA_ATOM,
-		32,
-		PropModeReplace,
-		(unsigned char *)&atoms[_NET_WM_STATE_ABOVE],
-		1
-	);
+		a = argb >> 24;
+		image->pixels[i] = (a << 24)
+		                 | ((((argb >> 16) & 0xFF) * a / 0xFF) << 16)
+		                 | ((((argb >> 8) & 0xFF) * a / 0xFF) << 8)
+		                 | (((argb & 0xFF) * a / 0xFF));
+	}
+	imlib_free_image();
+	image->w = w;
+	image->h = h;
+	image->box = box;
+	image->pixmap = None;
+	image->picture = None;
+	image->refcount = 0;
+	return image;
 }
 
 static void
-drawitem(struct Item *item)
+cacheimage(struct Image *image, const char *path, time_t mtime, off_t size)
 {
-	Pixmap pixmap, fg, alpha;
-	Picture picture;
-	Imlib_Image image = NULL;
-	const char *text;
-	size_t len, j;
-	int xaligned;
-	int bar, i, x, y, newh;
-	int texth, imgh, imgw;
-	int origimgw, origimgh;
+	image->path = estrdup(path);
+	image->mtime = mtime;
+	image->size = size;
+	images.nbytes += (size_t)image->w * image->h * sizeof(*image->pixels);
+	pushimage(image);
+}
 
-	pixmap = XCreatePixmap(dpy, item->win, item->w, max_height, depth);
-	picture = XRenderCreatePicture(dpy, pixmap, xformat, 0, NULL);
-	XRenderFillRectangle(
-		dpy,
-		PictOpSrc,
-		picture,
-		&item->background,
-		0, 0,
-		item->w,
-		max_height
-	);
+static void *
+decodeworker(void *arg)
+{
+	struct Job *job;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&jobs.mutex);
+		while (jobs.todo == NULL && !jobs.quit)
+			pthread_cond_wait(&jobs.cond, &jobs.mutex);
+		if (jobs.quit) {
+			pthread_mutex_unlock(&jobs.mutex);
+			return NULL;
+		}
+		job = jobs.todo;
+		if ((jobs.todo = job->next) == NULL)
+			jobs.todotail = NULL;
+		pthread_mutex_unlock(&jobs.mutex);
+
+		job->usec = getusec();
+		job->image = decodeimage(job->path, job->box);
+		job->usec = getusec() - job->usec;
+
+		pthread_mutex_lock(&jobs.mutex);
+		job->next = jobs.done;
+		jobs.done = job;
+		pthread_mutex_unlock(&jobs.mutex);
+
+		/* wake up the main loop */
+		while (write(jobs.pipefd[1], "", 1) == -1 && errno == EINTR)
+			;
+	}
+}
 
-	/* draw opacity */
-	alpha = XRenderCreateSolidFill(dpy, &(XRenderColor){
-		.red = 0, .green = 0, .blue = 0,
-		.alpha = opacity
-	});
+static void
+initjobs(void)
+{
+	sigset_t all, old;
+	int i, flags;
+
+	jobs.todo = jobs.todotail = jobs.done = NULL;
+	jobs.quit = false;
+	if (pipe(jobs.pipefd) == -1)
+		err(1, "pipe");
+	for (i = 0; i < 2; i++) {
+		if ((flags = fcntl(jobs.pipefd[i], F_GETFL)) == -1)
+			err(1, "fcntl");
+		if (fcntl(jobs.pipefd[i], F_SETFL, flags | O_NONBLOCK) == -1)
+			err(1, "fcntl");
+	}
+	if ((errno = pthread_mutex_init(&jobs.mutex, NULL)) != 0)
+		err(1, "pthread_mutex_init");
+	if ((errno = pthread_cond_init(&jobs.cond, NULL)) != 0)
+		err(1, "pthread_cond_init");
+
+	/* signals must interrupt poll(2) in the main thread, not the decoder */
+	sigfillset(&all);
+	if ((errno = pthread_sigmask(SIG_SETMASK, &all, &old)) != 0)
+		err(1, "pthread_sigmask");
+	if ((errno = pthread_create(&jobs.thread, NULL, decodeworker, NULL)) != 0)
+		err(1, "pthread_create");
+	if ((errno = pthread_sigmask(SIG_SETMASK, &old, NULL)) != 0)
+		err(1, "pthread_sigmask");
+}
+
+static void
+termjobs(void)
+{
+	struct Job *job;
+
+	pthread_mutex_lock(&jobs.mutex);
+	jobs.quit = true;
+	pthread_cond_signal(&jobs.cond);
+	pthread_mutex_unlock(&jobs.mutex);
+	pthread_join(jobs.thread, NULL);
+	while ((job = jobs.todo) != NULL) {
+		jobs.todo = job->next;
+		free(job->path);
+		free(job);
+	}
+	while ((job = jobs.done) != NULL) {
+		jobs.done = job->next;
+		if (job->image != NULL) {
+			free(job->image->pixels);
+			free(job->image);
+		}
+		free(job->path);
+		free(job);
+	}
+	close(jobs.pipefd[0]);
+	close(jobs.pipefd[1]);
+	pthread_cond_destroy(&jobs.cond);
+	pthread_mutex_destroy(&jobs.mutex);
+}
+
+static void
+requestimage(const char *path, int box, time_t mtime, off_t size)
+{
+	struct Job *job;
+
+	job = emalloc(sizeof(*job));
+	job->next = NULL;
+	job->path = estrdup(path);
+	job->mtime = mtime;
+	job->size = size;
+	job->box = box;
+	job->image = NULL;
+	job->usec = 0;
+	pthread_mutex_lock(&jobs.mutex);
+	if (jobs.todotail != NULL)
+		jobs.todotail->next = job;
+	else
+		jobs.todo = job;
+	jobs.todotail = job;
+	pthread_cond_signal(&jobs.cond);
+	pthread_mutex_unlock(&jobs.mutex);
+}
+
+static struct Image *
+getimage(const char *path, int box, bool *loading)
+{
+	struct Image *image, *next;
+	struct Item *item;
+	struct stat sb;
+
+	/*
+	 * Return the image in the file at path scaled to fit in a box×box
+	 * square, if it is in the cache already.  Otherwise, request it to
+	 * be decoded by the decoder thread, return NULL and set *loading.
+	 */
+	*loading = false;
+	if (*path == '\0') {
+		warnx("could not load image (file name is blank)");
+		return NULL;
+	}
+	if (stat(path, &sb) == -1) {
+		warn("could not load image: %s", path);
+		return NULL;
+	}
+	for (image = images.head; image != NULL; image = next) {
+		next = image->next;
+		if (image->box != box || strcmp(image->path, path) != 0)
+			continue;
+		if (image->mtime == sb.st_mtime && image->size == sb.st_size) {
+			images.hits++;
+			unlinkimage(image);
+			pushimage(image);
+			goto done;
+		}
+		/* the file has changed */
+		if (image->refcount == 0) {
+			freeimage(image);
+		}
+	}
+	images.misses++;
+	*loading = true;
+	for (item = queue.head; item != NULL; item = item->next)
+		if (item->loading && item->loadbox == box && strcmp(item->file, path) == 0)
+			return NULL;    /* already requested */
+	requestimage(path, box, sb.st_mtime, sb.st_size);
+	return NULL;
+done:
+	image->refcount++;
+	trimimages();
+	return image;
+}
+
+static void
+putimage(struct Image *image)
+{
+	if (image == NULL)
+		return;
+	image->refcount--;
+	trimimages();
+}
+
+static void
+drawimage(struct Image *image, Picture picture, int x, int y)
+{
+	XImage *ximage;
+	GC gc;
+	union {
+		int i;
+		char c;
+	} endian = { .i = 1 };
+
+	if (image->picture == None) {
+		/* upload the image to the server the first time it is drawn */
+		image->pixmap = XCreatePixmap(dpy, root, image->w, image->h, 32);
+		image->picture = XRenderCreatePicture(
+			dpy,
+			image->pixmap,
+			XRenderFindStandardFormat(dpy, PictStandardARGB32),
+			0, NULL
+		);
+		ximage = XCreateImage(
+			dpy,
+			visual,
+			32,
+			ZPixmap,
+			0,
+			(char *)image->pixels,
+			image->w,
+			image->h,
+			32,
+			0
+		);
+		/* pixels are in the byte order of the client */
+		ximage->byte_order = endian.c ? LSBFirst : MSBFirst;
+		gc = XCreateGC(dpy, image->pixmap, 0, NULL);
+		XPutImage(dpy, image->pixmap, gc, ximage, 0, 0, 0, 0, image->w, image->h);
+		XFreeGC(dpy, gc);
+		ximage->data = NULL;
+		XDestroyImage(ximage);
+		free(image->pixels);
+		image->pixels = NULL;
+	}
 	XRenderComposite(
 		dpy,
-		PictOpSrc,
-		picture,
-		alpha,
+		PictOpOver,
+		image->picture,
+		None,
 		picture,
 		0, 0,
 		0, 0,
-		0, 0,
-		item->w,
-		max_height
+		x, y,
+		image->w,
+		image->h
 	);
+}
 
-	/* draw image */
-	y = padding_pixels;
-	fg = XRenderCreateSolidFill(dpy, &item->foreground);
-	imgw = imgh = 0;
-	if (item->image && item->imgw > 0) {
-		imlib_context_set_image(item->image);
-		imlib_context_set_drawable(pixmap);
-		origimgw = imlib_image_get_width();
-		origimgh = imlib_image_get_height();
-		if (imgw > imgh) {
-			imgw = item->imgw;
-			imgh = (origimgh * item->imgw) / origimgw;
-		} else {
-			imgw = (origimgw * item->imgw) / origimgh;
-			imgh = item->imgw;
+static Window
+createwindow(int w, int h)
+{
+	Window win;
+
+	win = XCreateWindow(
+		dpy, root,
+		0, 0,           /* placed at (0,0) for now; will be moved later */
+		w,
+		h,
+		0,
+		depth,
+		InputOutput,
+		visual,
+		CWOverrideRedirect | CWBackPixel | CWBorderPixel |
+		CWSaveUnder | CWEventMask | CWColormap,
+		&(XSetWindowAttributes){
+			.override_redirect = wflag ? False : True,
+			.background_pixel = 0,
+			.border_pixel =0,
+			.colormap = colormap,
+			.save_under = True,
+			.event_mask = ButtonPressMask | PointerMotionMask,
+		}
+	);
+	XmbSetWMProperties(
+		dpy, win,
+		APP_CLASS,      /* title name */
+		APP_CLASS,      /* icon name */
+		saveargv,
+		saveargc,
+		NULL,
+		NULL,
+		&(XClassHint){
+			.res_class = APP_CLASS,
+			.res_name = APP_NAME,
 		}
-		image = imlib_create_cropped_scaled_image(0, 0, origimgw, origimgh, imgw, imgh);
-		imlib_free_image();
-		imlib_context_set_image(image);
-		imlib_render_image_on_drawable(
-			padding_pixels + (item->imgw - imgw) / 2,
-			padding_pixels + (item->imgw - imgh) / 2
+	);
+	XChangeProperty(
+		dpy,
+		win,
+		atoms[_NET_WM_NAME],
+		atoms[UTF8_STRING],
+		8,
+		PropModeReplace,
+		(unsigned char *)APP_CLASS,
+		strlen(APP_CLASS)
+	);
+	XChangeProperty(
+		dpy,
+		win,
+		atoms[_NET_WM_WINDOW_TYPE],
+		XA_ATOM,
+		32,
+		PropModeReplace,
+		(unsigned char *)&atoms[_NET_WM_WINDOW_TYPE_NOTIFICATION],
+		1
+	);
+	XChangeProperty(
+		dpy,
+		win,
+		atoms[_NET_WM_STATE],
+		XA_ATOM,
+		32,
+		PropModeReplace,
+		(unsigned char *)&atoms[_NET_WM_STATE_ABOVE],
+		1
+	);
+
+	return win;
+}
+
+static void
+initwindows(void)
+{
+	/* create windows in advance, so notifications can borrow them */
+	winpool.wins = emalloc(MAX(winpool.max, 1) * sizeof(*winpool.wins));
+	winpool.nwins = 0;
+	while (winpool.nwins < MIN(winpool_size, winpool.max)) {
+		winpool.wins[winpool.nwins++] = createwindow(
+			queue.w,
+			MAX(queue.h, 1)
 		);
-		imlib_free_image();
 	}
+}
 
-	/* draw text */
-	texth = 0;
-	for (i = 0; item->textw > 0 && i < item->nlines; i++) {
-		text = item->line[i];
-		x = padding_pixels;
-		x += (image && item->imgw > 0 ? item->imgw + padding_pixels : 0);
-		while (texth <= max_height) {
-			for (len = j = 0; text[len] != '\0'; len = j, j += strcspn(text + j, " \t")) {
-				j += strspn(text + j, " \t");
-				xaligned = ctrlfnt_width(fontset, text, j);
-				if (xaligned > item->textw)
-					break;
+static Window
+getwindow(int w, int h)
+{
+	Window win;
+
+	if (winpool.nwins == 0)
+		return createwindow(w, h);
+	win = winpool.wins[--winpool.nwins];
+	XResizeWindow(dpy, win, w, h);
+	return win;
+}
+
+static void
+putwindow(Window win)
+{
+	if (winpool.nwins >= winpool.max) {
+		XDestroyWindow(dpy, win);
+		return;
+	}
+	XUnmapWindow(dpy, win);
+	/* release the backing pixmap, which goes back to its own pool */
+	XSetWindowBackgroundPixmap(dpy, win, None);
+	winpool.wins[winpool.nwins++] = win;
+}
+
+static void
+termwindows(void)
+{
+	while (winpool.nwins > 0)
+		XDestroyWindow(dpy, winpool.wins[--winpool.nwins]);
+	free(winpool.wins);
+}
+
+static struct Backing *
+getbacking(int w, int h)
+{
+	struct Backing *backing, **p;
+
+	/* reuse an idle backing pixmap of the same size and depth */
+	for (p = &pool; *p != NULL; p = &(*p)->next) {
+		backing = *p;
+		if (backing->w == w && backing->h == h && backing->depth == depth) {
+			*p = backing->next;
+			return backing;
+		}
+	}
+	backing = emalloc(sizeof(*backing));
+	backing->w = w;
+	backing->h = h;
+	backing->depth = depth;
+	backing->pixmap = XCreatePixmap(dpy, root, w, h, depth);
+	backing->picture = XRenderCreatePicture(dpy, backing->pixmap, xformat, 0, NULL);
+	return backing;
+}
+
+static void
+freebacking(struct Backing *backing)
+{
+	XRenderFreePicture(dpy, backing->picture);
+	XFreePixmap(dpy, backing->pixmap);
+	free(backing);
+}
+
+static void
+putbacking(struct Backing *backing)
+{
+	struct Backing **p;
+	int n;
+
+	if (backing == NULL)
+		return;
+	backing->idle = getmsec();
+	backing->next = pool;
+	pool = backing;
+
+	/* keep at most POOLMAX idle pixmaps, dropping the least recent */
+	for (n = 0, p = &pool; *p != NULL && n < POOLMAX; p = &(*p)->next)
+		n++;
+	while (*p != NULL) {
+		backing = *p;
+		*p = backing->next;
+		freebacking(backing);
+	}
+}
+
+static int
+trimpool(long long now)
+{
+	struct Backing *backing, **p;
+
+	/*
+	 * Give the memory of pixmaps idle for POOLIDLE back to the server.
+	 * Return the time in milliseconds until the next one will be idle
+	 * for that long, or -1 if the pool is empty.
+	 */
+	for (p = &pool; *p != NULL; p = &(*p)->next)
+		if (now - (*p)->idle >= POOLIDLE)
+			break;
+	while (*p != NULL) {
+		/* the list is sorted from the most to the least recent */
+		backing = *p;
+		*p = backing->next;
+		freebacking(backing);
+	}
+	if (pool == NULL)
+		return -1;
+	for (backing = pool; backing->next != NULL; backing = backing->next)
+		;
+	return POOLIDLE - (now - backing->idle);
+}
+
+static int
+badgewidth(const struct Item *item, char *buf, size_t size, int *len)
+{
+	/* return the width of the "×N" badge of coalesced notifications */
+	*len = snprintf(buf, size, "\xC3\x97%lu", item->ndups);
+	return ctrlfnt_width(fontset, buf, *len);
+}
+
+static size_t
+breakline(const char *text, int maxw, int *width)
+{
+	size_t len, j;
+	int w, segw;
+
+	/*
+	 * Return the length of the longest prefix of text that ends at a
+	 * word boundary and fits in maxw pixels, and set *width to its width.
+	 * Each word (along with the blanks after it) is measured once, and
+	 * the widths are summed up as we scan forward.
+	 */
+	w = 0;
+	for (len = j = 0; text[len] != '\0'; len = j) {
+		j += strcspn(text + j, " \t");
+		j += strspn(text + j, " \t");
+		segw = ctrlfnt_width(fontset, text + len, j - len);
+		if (w + segw > maxw)
+			break;
+		w += segw;
+	}
+	*width = w;
+	return len;
+}
+
+static void
+layoutitem(struct Item *item)
+{
+	const char *text;
+	char buf[32];
+	size_t len;
+	int i, n, w, x, y, maxw, newh, texth;
+
+	/*
+	 * Compute the geometry of the notification and of everything drawn
+	 * in it, without touching the X server: the notification width and
+	 * height, the wrapped lines of text, and the image and bar boxes.
+	 */
+
+	/* the badge of coalesced notifications goes at the end of the first run */
+	item->badgew = 0;
+	if (item->ndups > 1)
+		item->badgew = badgewidth(item, buf, sizeof(buf), &n) + padding_pixels;
+
+	/* compute notification width */
+	item->imgw = image_pixels;
+	for (w = i = 0; i < item->nlines; i++) {
+		text = item->text + item->lines[i].off;
+		x = ctrlfnt_width(fontset, text, item->lines[i].len);
+		w = MAX(w, x + (i == 0 ? item->badgew : 0));
+	}
+	if (shrink) {
+		if (item->file != NULL) {
+			item->textw = queue.w - image_pixels - padding_pixels * 3;
+			item->textw = MIN(w, item->textw);
+			item->w = item->textw + image_pixels + padding_pixels * 3;
+		} else {
+			item->textw = queue.w - padding_pixels * 2;
+			item->textw = MIN(w, item->textw);
+			item->w = item->textw + padding_pixels * 2;
+		}
+	} else {
+		item->w = queue.w;
+		if (item->file != NULL) {
+			item->textw = queue.w - image_pixels - padding_pixels * (2 + (item->nlines > 0 ? 1 : 0));
+			if (!image_pixels) {
+				item->textw = MIN(item->textw, w);
 			}
+			item->imgw = queue.w - item->textw - padding_pixels * (2 + (item->nlines > 0 ? 1 : 0));
+		} else {
+			item->textw = queue.w - padding_pixels * 2;
+		}
+	}
+
+	/* get the image scaled to fit into an imgw×imgw box */
+	item->imgbox = (XRectangle){ 0 };
+	if (item->file != NULL && item->imgw > 0) {
+		if (item->image == NULL && !item->loading) {
+			item->image = getimage(item->file, item->imgw, &item->loading);
+			item->loadbox = item->imgw;
+		}
+		if (item->image != NULL) {
+			item->imgbox.width = item->image->w;
+			item->imgbox.height = item->image->h;
+		} else if (item->loading) {
+			/* reserve the whole box until the image is decoded */
+			item->imgbox.width = item->imgw;
+			item->imgbox.height = item->imgw;
+		} else {
+			/* lay out the notification as if it had no image */
+			item->file = NULL;
+			layoutitem(item);
+			return;
+		}
+		item->imgbox.x = padding_pixels + (item->imgw - item->imgbox.width) / 2;
+		item->imgbox.y = padding_pixels + (item->imgw - item->imgbox.height) / 2;
+	}
+
+	/* a badge wider than the text would leave no room for it */
+	if (item->badgew >= item->textw)
+		item->badgew = 0;
+
+	/* break text into lines */
+	y = padding_pixels;
+	texth = 0;
+	item->nruns = 0;
+	for (i = 0; item->textw > 0 && i < item->nlines && texth <= max_height; i++) {
+		text = item->text + item->lines[i].off;
+		while (texth <= max_height && item->nruns < item->maxruns) {
+			maxw = item->textw - (item->nruns == 0 ? item->badgew : 0);
+			len = breakline(text, maxw, &w);
 			if (len < 1)
 				break;
-			if (xaligned <= 0)
+			if (w <= 0)
 				break;
+			x = padding_pixels;
+			x += (item->imgbox.width > 0 ? item->imgw + padding_pixels : 0);
 			switch (alignment) {
 			case LeftAlignment:
 				break;
 			case CenterAlignment:
-				xaligned = (item->textw - xaligned) / 2;
-				x = MAX(x, xaligned);
+				x = MAX(x, (maxw - w) / 2);
 				break;
 			case RightAlignment:
-				xaligned = item->textw - xaligned;
-				x = MAX(x, xaligned);
+				x = MAX(x, maxw - w);
 				break;
 			default:
 				break;
 			}
-			ctrlfnt_draw(
-				fontset,
-				picture,
-				fg,
-				(XRectangle){
-					.x = x,
-					.y = y + texth,
-					.width = item->textw,
-					.height = fonth,
-				},
-				text, len
-			);
+			item->runs[item->nruns++] = (struct Run){
+				.text = text,
+				.len = len,
+				.x = x,
+				.y = y + texth,
+			};
 			texth += fonth + leading_pixels;
 			text += len;
 		}
@@ -726,350 +1760,1726 @@ drawitem(struct Item *item)
 	if (texth > leading_pixels)
 		texth -= leading_pixels;
 
-	x = padding_pixels;
-	x += (image && item->imgw > 0 ? item->imgw + padding_pixels : 0);
-	/* draw bar */
+	/* place bar below text */
+	item->barbox = (XRectangle){ 0 };
 	if (item->bar > 0) {
-		bar = (item->textw * item->bar) / 100;
-		bar = MIN(bar, item->textw);
-		XRenderFillRectangle(
-			dpy,
-			PictOpSrc,
-			picture,
-			&item->foreground,
-			x, y + texth,
-			bar,
-			fonth
-		);
+		item->barbox.x = padding_pixels;
+		item->barbox.x += (item->imgbox.width > 0 ? item->imgw + padding_pixels : 0);
+		item->barbox.y = y + texth;
+		item->barbox.width = MIN((item->textw * item->bar) / 100, item->textw);
+		item->barbox.height = fonth;
+		texth += fonth;
+	}
+
+	/* compute notification height based on its contents */
+	newh = MAX(item->imgbox.height, texth) + 2 * padding_pixels;
+	item->h = MAX(queue.h, MIN(newh, max_height));
+}
+
+static void
+drawbadge(struct Item *item)
+{
+	Picture picture, fg, alpha;
+	XRectangle box;
+	char buf[32];
+	int len, w;
+
+	/*
+	 * Draw the number of coalesced notifications at the top right
+	 * corner, in the room layoutitem() kept free at the end of the
+	 * first run.
+	 */
+	w = badgewidth(item, buf, sizeof(buf), &len);
+	box = (XRectangle){
+		.x = MAX(item->w - w - padding_pixels, 0),
+		.y = padding_pixels,
+		.width = w,
+		.height = fonth,
+	};
+	picture = item->backing->picture;
+	XRenderFillRectangle(
+		dpy,
+		PictOpSrc,
+		picture,
+		&item->background,
+		box.x, box.y,
+		box.width,
+		box.height
+	);
+	alpha = XRenderCreateSolidFill(dpy, &(XRenderColor){
+		.red = 0, .green = 0, .blue = 0,
+		.alpha = opacity
+	});
+	XRenderComposite(
+		dpy,
+		PictOpSrc,
+		picture,
+		alpha,
+		picture,
+		box.x, box.y,
+		0, 0,
+		box.x, box.y,
+		box.width,
+		box.height
+	);
+	fg = XRenderCreateSolidFill(dpy, &item->foreground);
+	ctrlfnt_draw(fontset, picture, fg, box, buf, len);
+	XRenderFreePicture(dpy, fg);
+	XRenderFreePicture(dpy, alpha);
+}
+
+static void
+drawitem(struct Item *item)
+{
+	Pixmap pixmap, fg, alpha;
+	Picture picture;
+	struct Backing *backing;
+	long long start;
+	int i;
+
+	start = getusec();
+	TRACE1(draw__start, item->id);
+
+	/*
+	 * The backing pixmap has the exact size computed by layoutitem().
+	 * Return the old one first, so a redraw of the same size reuses it.
+	 */
+	putbacking(item->backing);
+	backing = getbacking(item->w, item->h);
+	item->backing = backing;
+	pixmap = backing->pixmap;
+	picture = backing->picture;
+	XRenderFillRectangle(
+		dpy,
+		PictOpSrc,
+		picture,
+		&item->background,
+		0, 0,
+		item->w,
+		item->h
+	);
+
+	/* draw opacity */
+	alpha = XRenderCreateSolidFill(dpy, &(XRenderColor){
+		.red = 0, .green = 0, .blue = 0,
+		.alpha = opacity
+	});
+	XRenderComposite(
+		dpy,
+		PictOpSrc,
+		picture,
+		alpha,
+		picture,
+		0, 0,
+		0, 0,
+		0, 0,
+		item->w,
+		item->h
+	);
+
+	/* draw image */
+	fg = XRenderCreateSolidFill(dpy, &item->foreground);
+	if (item->image != NULL) {
+		drawimage(item->image, picture, item->imgbox.x, item->imgbox.y);
+	} else if (item->loading) {
+		/* draw a placeholder box */
+		XRenderFillRectangle(
+			dpy,
+			PictOpOver,
+			picture,
+			&(XRenderColor){
+				.red   = item->foreground.red   / 8,
+				.green = item->foreground.green / 8,
+				.blue  = item->foreground.blue  / 8,
+				.alpha = 0xFFFF / 8,
+			},
+			item->imgbox.x,
+			item->imgbox.y,
+			item->imgbox.width,
+			item->imgbox.height
+		);
+	}
+
+	/* draw text */
+	for (i = 0; i < item->nruns; i++) {
+		ctrlfnt_draw(
+			fontset,
+			picture,
+			fg,
+			(XRectangle){
+				.x = item->runs[i].x,
+				.y = item->runs[i].y,
+				.width = item->textw,
+				.height = fonth,
+			},
+			item->runs[i].text,
+			item->runs[i].len
+		);
+	}
+
+	/* draw bar */
+	if (item->barbox.width > 0) {
+		XRenderFillRectangle(
+			dpy,
+			PictOpSrc,
+			picture,
+			&item->foreground,
+			item->barbox.x,
+			item->barbox.y,
+			item->barbox.width,
+			item->barbox.height
+		);
+	}
+
+	if (item->ndups > 1)
+		drawbadge(item);
+
+	/* change border color */
+	XSetWindowBackgroundPixmap(dpy, item->win, pixmap);
+	XClearWindow(dpy, item->win);
+	XRenderFreePicture(dpy, fg);
+	XRenderFreePicture(dpy, alpha);
+	observe(&metrics.draw, getusec() - start);
+	TRACE1(draw__done, item->id);
+}
+
+static void
+finishjob(struct Job *job)
+{
+	struct Item *item;
+	int w, h;
+
+	observe(&metrics.decode, job->usec);
+	if (job->image != NULL)
+		cacheimage(job->image, job->path, job->mtime, job->size);
+
+	/* show the image on (or remove it from) the notifications waiting for it */
+	for (item = queue.head; item != NULL; item = item->next) {
+		/* imgw may have changed since, e.g. when a badge was added */
+		if (!item->loading || item->loadbox != job->box || strcmp(item->file, job->path) != 0)
+			continue;
+		item->loading = false;
+		if (job->image != NULL) {
+			item->image = job->image;
+			item->image->refcount++;
+		} else {
+			/* lay out the notification as if it had no image */
+			item->file = NULL;
+		}
+		w = item->w;
+		h = item->h;
+		TRACE1(layout__start, item->id);
+		layoutitem(item);
+		TRACE2(layout__done, item->id, item->h);
+
+		/* do not shrink a notification that has got its image */
+		if (item->image != NULL)
+			item->h = MAX(item->h, h);
+		if (item->w != w || item->h != h) {
+			XResizeWindow(dpy, item->win, item->w, item->h);
+			dirtyitem(item);
+		}
+		drawitem(item);
+	}
+	free(job->path);
+	free(job);
+}
+
+static void
+readjobs(void)
+{
+	struct Job *job, *done;
+	char buf[64];
+
+	while (read(jobs.pipefd[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&jobs.mutex);
+	done = jobs.done;
+	jobs.done = NULL;
+	pthread_mutex_unlock(&jobs.mutex);
+	while ((job = done) != NULL) {
+		done = job->next;
+		finishjob(job);
+	}
+	trimimages();
+}
+
+static void
+swaptimers(size_t i, size_t j)
+{
+	struct Item *item;
+
+	item = timers.items[i];
+	timers.items[i] = timers.items[j];
+	timers.items[j] = item;
+	timers.items[i]->heapidx = i;
+	timers.items[j]->heapidx = j;
+}
+
+static void
+fixtimer(size_t i)
+{
+	size_t child;
+
+	/* sift up */
+	while (i > 0 && timers.items[i]->deadline < timers.items[(i - 1) / 2]->deadline) {
+		swaptimers(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	/* sift down */
+	while ((child = 2 * i + 1) < timers.nitems) {
+		if (child + 1 < timers.nitems &&
+		    timers.items[child + 1]->deadline < timers.items[child]->deadline)
+			child++;
+		if (timers.items[i]->deadline <= timers.items[child]->deadline)
+			break;
+		swaptimers(i, child);
+		i = child;
+	}
+}
+
+static void
+addtimer(struct Item *item)
+{
+	if (timers.nitems == timers.capacity) {
+		timers.capacity = (timers.capacity == 0) ? 64 : timers.capacity * 2;
+		timers.items = erealloc(timers.items, timers.capacity * sizeof(*timers.items));
+	}
+	item->heapidx = timers.nitems++;
+	timers.items[item->heapidx] = item;
+	fixtimer(item->heapidx);
+}
+
+static void
+deltimer(struct Item *item)
+{
+	size_t i;
+
+	if (item->msec == 0)
+		return;
+	i = item->heapidx;
+	if (i != --timers.nitems) {
+		swaptimers(i, timers.nitems);
+		fixtimer(i);
+	}
+}
+
+static void
+resettime(struct Item *item)
+{
+	if (item->msec == 0)
+		return;
+	item->deadline = getmsec() + item->msec;
+	fixtimer(item->heapidx);
+}
+
+static void
+coalesceitem(struct Item *item, unsigned long ndups)
+{
+	char buf[32];
+	int len, w, h;
+
+	/*
+	 * The same notification has come again; rather than opening
+	 * another window, extend the lifetime of the one on the screen
+	 * and update its count.
+	 */
+	item->ndups += ndups;
+	metrics.coalesced += ndups;
+	resettime(item);
+
+	/* only redraw the badge if it still fits in the room kept for it */
+	if (item->badgew > 0 &&
+	    badgewidth(item, buf, sizeof(buf), &len) + padding_pixels == item->badgew) {
+		drawbadge(item);
+		XClearWindow(dpy, item->win);
+		return;
+	}
+	w = item->w;
+	h = item->h;
+	layoutitem(item);
+	if (item->w != w || item->h != h) {
+		XResizeWindow(dpy, item->win, item->w, item->h);
+		dirtyitem(item);
+	}
+	drawitem(item);
+}
+
+static char *
+putfield(char *key, size_t *n, int type, const char *s, size_t len)
+{
+	char *value;
+
+	/* append a field to the key and return its value */
+	key[*n] = type;
+	value = memcpy(key + *n + 1, s, len);
+	value[len] = '\0';
+	*n += len + 2;
+	return value;
+}
+
+static void
+putline(struct Item *item, size_t *n, const char *s, size_t len)
+{
+	char *value;
+
+	value = putfield(item->key, n, 'l', s, len);
+	item->lines[item->nlines].off = value - item->text;
+	item->lines[item->nlines++].len = len;
+}
+
+static struct Item *
+newitem(const struct Itemspec *itemspec)
+{
+	static const char types[PARSE_NOPTIONS] = {
+		[PARSE_IMG] = 'i',
+		[PARSE_BG]  = 'b',
+		[PARSE_FG]  = 'f',
+		[PARSE_BRD] = 'r',
+		[PARSE_CMD] = 'c',
+	};
+	const ParseSpec *spec;
+	const ParseSlice *slice;
+	struct Item *item;
+	char bar[16], *value;
+	size_t i, n, keylen, taglen, barlen;
+	int nlines, maxruns;
+
+	spec = &itemspec->spec;
+
+	/*
+	 * The key of an item is what it looks like: a sequence of fields,
+	 * each one a type character followed by a nul-terminated string.
+	 * Empty lines are skipped when parsing, so notifications that look
+	 * the same get the same key.  Its size is known from the slices
+	 * alone, so the notification is copied once, into the item.
+	 */
+	keylen = 0;
+	for (i = 0; i < PARSE_NOPTIONS; i++)
+		if (types[i] != '\0' && (spec->options & (1U << i)))
+			keylen += spec->option[i].len + 2;
+	barlen = 0;
+	if (itemspec->bar >= 0) {
+		barlen = snprintf(bar, sizeof(bar), "%d", itemspec->bar);
+		keylen += barlen + 2;
+	}
+	nlines = itemspec->nlines;
+	if (spec->title.len > 0) {
+		keylen += spec->title.len + 2;
+		nlines++;
+	}
+	for (i = 0; i < itemspec->nlines; i++)
+		keylen += itemspec->lines[i].len + 2;
+	taglen = 0;
+	if (spec->options & (1U << PARSE_TAG))
+		taglen = spec->option[PARSE_TAG].len + 1;
+
+	/* the runs of text never get past max_height */
+	maxruns = max_height / MAX(fonth + leading_pixels, 1) + 1;
+
+	/* allocate the item, its runs, its lines and its strings at once */
+	item = emalloc(
+		sizeof(*item) +
+		maxruns * sizeof(*item->runs) +
+		nlines * sizeof(*item->lines) +
+		taglen +
+		keylen
+	);
+	item->runs = (struct Run *)(item + 1);
+	item->maxruns = maxruns;
+	item->lines = (struct Slice *)(item->runs + maxruns);
+	item->nlines = 0;
+	item->text = (char *)(item->lines + nlines);
+	item->tag = NULL;
+	if (taglen > 0) {
+		slice = &spec->option[PARSE_TAG];
+		item->tag = memcpy(item->text, itemspec->buf + slice->off, slice->len);
+		item->tag[slice->len] = '\0';
+	}
+
+	/* the lines, the command and the image file point into the key */
+	item->key = item->text + taglen;
+	item->cmd = NULL;
+	item->file = NULL;
+	n = 0;
+	for (i = 0; i < PARSE_NOPTIONS; i++) {
+		if (types[i] == '\0' || !(spec->options & (1U << i)))
+			continue;
+		slice = &spec->option[i];
+		value = putfield(item->key, &n, types[i], itemspec->buf + slice->off, slice->len);
+		if (i == PARSE_IMG)
+			item->file = value;
+		else if (i == PARSE_CMD)
+			item->cmd = value;
+	}
+	if (itemspec->bar >= 0)
+		(void)putfield(item->key, &n, 'p', bar, barlen);
+	if (spec->title.len > 0)
+		putline(item, &n, itemspec->buf + spec->title.off, spec->title.len);
+	for (i = 0; i < itemspec->nlines; i++)
+		putline(item, &n, itemspec->buf + itemspec->lines[i].off, itemspec->lines[i].len);
+	item->keylen = keylen;
+	item->hash = hashkey(item->key, keylen);
+	item->ndups = 1;
+	item->id = 0;
+	item->received = 0;
+	item->msec = itemspec->msec;
+	item->bar = itemspec->bar;
+	item->next = NULL;
+	return item;
+}
+
+static struct Item *
+additem(struct Item *item)
+{
+	size_t n;
+
+	/* realize an item made by newitem() */
+	item->next = NULL;
+	item->seq = queue.seq++;
+	item->mapped = false;
+	item->nruns = 0;
+	item->backing = NULL;
+	item->image = NULL;
+	item->loading = false;
+	if (!queue.head)
+		queue.head = item;
+	else
+		queue.tail->next = item;
+	item->prev = queue.tail;
+	queue.tail = item;
+
+	/* allocate colors, named by the fields before the lines of the key */
+	item->background = background;
+	item->foreground = foreground;
+	item->borderclr = borderclr;
+	for (n = 0; n < item->keylen && item->key[n] != 'l'; n += strlen(item->key + n + 1) + 2) {
+		switch (item->key[n]) {
+		case 'b':
+			setcolor(&item->background, item->key + n + 1);
+			break;
+		case 'f':
+			setcolor(&item->foreground, item->key + n + 1);
+			break;
+		case 'r':
+			setcolor(&item->borderclr, item->key + n + 1);
+			break;
+		}
+	}
+
+	/* compute notification geometry */
+	TRACE1(layout__start, item->id);
+	layoutitem(item);
+	TRACE2(layout__done, item->id, item->h);
+
+	/* call functions that set the item */
+	TRACE1(window__start, item->id);
+	item->win = getwindow(item->w, item->h);
+	TRACE2(window__done, item->id, item->win);
+	indexitem(item);
+	if (item->msec != 0) {
+		item->deadline = getmsec() + item->msec;
+		addtimer(item);
+	}
+	drawitem(item);
+
+	/* a new item was added to the queue, so the queue changed */
+	dirtyitem(item);
+	return item;
+}
+
+static void
+delitem(struct Item *item)
+{
+	TRACE1(delete, item->id);
+	unindexitem(item);
+	deltimer(item);
+	putwindow(item->win);
+	putbacking(item->backing);
+	putimage(item->image);
+	if (item == queue.summary) {
+		queue.summary = NULL;
+		queue.nmore = 0;
+	} else {
+		queue.nitems--;
+	}
+	if (queue.dirty == item)
+		queue.dirty = NULL;
+	dirtyitem(item->next);
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		queue.head = item->next;
+	if (item->next)
+		item->next->prev = item->prev;
+	else
+		queue.tail = item->prev;
+	free(item);
+}
+
+static void
+cmditem(struct Item *item)
+{
+	if (item->cmd != NULL)
+		printf("%s\n", item->cmd);
+	fflush(stdout);
+}
+
+static void
+addline(struct Itemspec *itemspec, size_t off, size_t len)
+{
+	ParseSlice *line;
+
+	/* the lines are kept from a notification to the next one */
+	if (itemspec->nlines == itemspec->maxlines) {
+		itemspec->maxlines = MAX(itemspec->maxlines * 2, 16);
+		itemspec->lines = erealloc(itemspec->lines, itemspec->maxlines * sizeof(*itemspec->lines));
+	}
+	line = &itemspec->lines[itemspec->nlines++];
+	line->off = off;
+	line->len = len;
+}
+
+static const char *
+getoption(const struct Itemspec *itemspec, int option, char *buf, size_t size)
+{
+	const ParseSlice *value;
+
+	/*
+	 * Return the value of a numeric option as a string in buf, or NULL
+	 * if it was not given or is too long to be a valid number.
+	 */
+	value = &itemspec->spec.option[option];
+	if (!(itemspec->spec.options & (1U << option)) || value->len >= size)
+		return NULL;
+	memcpy(buf, itemspec->buf + value->off, value->len);
+	buf[value->len] = '\0';
+	return buf;
+}
+
+static bool
+parseline(struct Itemspec *itemspec, const char *s, size_t len)
+{
+	ParseSlice field;
+	size_t pos, end;
+	char num[32];
+	const char *t;
+	int n;
+
+	/* the notification is not copied; the item is made from the slices */
+	if (parse_spec(s, len, &itemspec->spec) == -1)
+		return false;
+	itemspec->buf = s;
+	itemspec->bar = -1;
+	if ((t = getoption(itemspec, PARSE_BAR, num, sizeof(num))) != NULL && !getnum(&t, &n) && n <= 100)
+		itemspec->bar = n;
+	itemspec->msec = lifetime;
+	if ((t = getoption(itemspec, PARSE_SEC, num, sizeof(num))) != NULL && !getduration(t, &n))
+		itemspec->msec = n;
+
+	/* the body is split into lines at tabs and newlines */
+	itemspec->nlines = 0;
+	pos = itemspec->spec.body.off;
+	end = pos + itemspec->spec.body.len;
+	while (parse_field(s, end, &pos, &field))
+		addline(itemspec, field.off, field.len);
+	return true;
+}
+
+static unsigned long
+getu32(const char *s)
+{
+	const unsigned char *p = (const unsigned char *)s;
+
+	/* big-endian */
+	return (unsigned long)p[0] << 24 | (unsigned long)p[1] << 16 |
+	       (unsigned long)p[2] << 8 | (unsigned long)p[3];
+}
+
+static bool
+nextfield(const char **p, const char *end, int *type, const char **data, size_t *len)
+{
+	/*
+	 * Get the field at *p and advance *p past it.  A field is a type
+	 * byte, the length of the data in four bytes, the data, and a
+	 * nul byte, so the data can be used in place as a string.
+	 */
+	if (end - *p < FRAMEHDR + 1)
+		return false;
+	*type = (unsigned char)**p;
+	*len = getu32(*p + 1);
+	if (*len > (size_t)(end - *p) - FRAMEHDR - 1)
+		return false;
+	*data = *p + FRAMEHDR;
+	if ((*data)[*len] != '\0')
+		return false;
+	*p = *data + *len + 1;
+	return true;
+}
+
+static void
+setoption(struct Itemspec *itemspec, int option, const char *data)
+{
+	itemspec->spec.options |= 1U << option;
+	itemspec->spec.option[option].off = data - itemspec->buf;
+	itemspec->spec.option[option].len = strlen(data);
+}
+
+static bool
+parseframe(struct Itemspec *itemspec, const char *buf, size_t size)
+{
+	const char *p, *data;
+	size_t len;
+	unsigned long msec;
+	int type;
+
+	itemspec->buf = buf;
+	itemspec->spec.options = 0;
+	itemspec->spec.title.off = itemspec->spec.title.len = 0;
+	itemspec->spec.body.off = itemspec->spec.body.len = 0;
+	itemspec->nlines = 0;
+	itemspec->bar = -1;
+	itemspec->msec = lifetime;
+
+	/*
+	 * The fields are used in place, up to their first nul, and body
+	 * fields are split into lines at newlines.  Unknown fields are
+	 * ignored.
+	 */
+	for (p = buf; p < buf + size; ) {
+		if (!nextfield(&p, buf + size, &type, &data, &len)) {
+			warnx("malformed notification frame");
+			return false;
+		}
+		switch (type) {
+		case FIELD_TITLE:
+			itemspec->spec.title.off = data - buf;
+			itemspec->spec.title.len = strlen(data);
+			break;
+		case FIELD_BODY:
+			for (; *data != '\0'; data += len + (data[len] == '\n'))
+				if ((len = strcspn(data, "\n")) > 0)
+					addline(itemspec, data - buf, len);
+			break;
+		case FIELD_IMG:
+			setoption(itemspec, PARSE_IMG, data);
+			break;
+		case FIELD_BG:
+			setoption(itemspec, PARSE_BG, data);
+			break;
+		case FIELD_FG:
+			setoption(itemspec, PARSE_FG, data);
+			break;
+		case FIELD_BRD:
+			setoption(itemspec, PARSE_BRD, data);
+			break;
+		case FIELD_TAG:
+			setoption(itemspec, PARSE_TAG, data);
+			break;
+		case FIELD_CMD:
+			setoption(itemspec, PARSE_CMD, data);
+			break;
+		case FIELD_TIME:
+			if (len == 4 && (msec = getu32(data)) <= INT_MAX)
+				itemspec->msec = msec;
+			break;
+		case FIELD_BAR:
+			if (len == 1 && (unsigned char)data[0] <= 100)
+				itemspec->bar = (unsigned char)data[0];
+			break;
+		default:
+			break;
+		}
+	}
+	if (itemspec->spec.title.len == 0 && !(itemspec->spec.options & (1U << PARSE_IMG)))
+		return false;
+	return true;
+}
+
+static int
+timeitems(long long now)
+{
+	/*
+	 * Delete the items whose deadline has passed.  Return the number
+	 * of milliseconds until the next deadline, or -1 if there is none.
+	 */
+	while (timers.nitems > 0 && timers.items[0]->deadline <= now) {
+		metrics.expired++;
+		TRACE1(expire, timers.items[0]->id);
+		delitem(timers.items[0]);
+	}
+	if (timers.nitems == 0)
+		return -1;
+	return MIN(timers.items[0]->deadline - now, INT_MAX);
+}
+
+static void
+moveitems(void)
+{
+	struct Item *item, *prev;
+	long long now = 0;
+	int x, y;
+	int h = 0;
+
+	/*
+	 * A notification has been deleted, added or resized; reorder the
+	 * queue of notifications, starting at the first one that may have
+	 * moved.  The items before it keep their place.
+	 */
+	if ((item = queue.dirty) == NULL)
+		return;
+	if ((prev = item->prev) != NULL)
+		h = prev->offset + prev->h + gap_pixels + border_pixels * 2;
+	for (; item; item = item->next) {
+		x = queue.x + mon.x;
+		y = queue.y + mon.y;
+		switch (gravity) {
+		case NorthWestGravity:
+			break;
+		case NorthGravity:
+			x += (mon.w - item->w) / 2 - border_pixels;
+			break;
+		case NorthEastGravity:
+			x += mon.w - item->w - border_pixels * 2;
+			break;
+		case WestGravity:
+			y += (mon.h - item->h) / 2 - border_pixels;
+			break;
+		case CenterGravity:
+			x += (mon.w - item->w) / 2 - border_pixels;
+			y += (mon.h - item->h) / 2 - border_pixels;
+			break;
+		case EastGravity:
+			x += mon.w - item->w - border_pixels * 2;
+			y += (mon.h - item->h) / 2 - border_pixels;
+			break;
+		case SouthWestGravity:
+			y += mon.h - item->h - border_pixels * 2;
+			break;
+		case SouthGravity:
+			x += (mon.w - item->w) / 2 - border_pixels;
+			y += mon.h - item->h - border_pixels * 2;
+			break;
+		case SouthEastGravity:
+			x += mon.w - item->w - border_pixels * 2;
+			y += mon.h - item->h - border_pixels * 2;
+			break;
+		}
+
+		if (direction == DownWards)
+			y += h;
+		else
+			y -= h;
+		item->offset = h;
+		h += item->h + gap_pixels + border_pixels * 2;
+		if (!item->mapped || item->x != x || item->y != y) {
+			XMoveWindow(dpy, item->win, x, y);
+			item->x = x;
+			item->y = y;
+		}
+		if (!item->mapped) {
+			XMapWindow(dpy, item->win);
+			item->mapped = true;
+			TRACE2(map, item->id, item->received);
+			if (item->received != 0) {
+				if (now == 0)
+					now = getusec();
+				observe(&metrics.latency, now - item->received);
+			}
+		}
+	}
+
+	queue.dirty = NULL;
+}
+
+static void
+cleanitems(const char *tag)
+{
+	struct Item *item;
+	struct Item *tmp;
+
+	/*
+	 * Free all notification items of the given tag;
+	 * or free all items if tag is NULL
+	 */
+	if (tag == NULL) {
+		while (queue.head != NULL)
+			delitem(queue.head);
+		return;
+	}
+	if (idx.nbuckets == 0)
+		return;
+	item = idx.tagbuckets[hashkey(tag, strlen(tag)) & (idx.nbuckets - 1)];
+	while (item) {
+		tmp = item;
+		item = item->tagchain;
+		if (strcmp(tmp->tag, tag) == 0) {
+			delitem(tmp);
+		}
+	}
+}
+
+static struct Item *
+unlinkpending(struct Item *prev, struct Item *pending)
+{
+	if (prev != NULL)
+		prev->next = pending->next;
+	else
+		frame.head = pending->next;
+	if (frame.tail == pending)
+		frame.tail = prev;
+	frame.npending--;
+	return pending;
+}
+
+static void
+delpending(struct Item *prev, struct Item *pending)
+{
+	free(unlinkpending(prev, pending));
+}
+
+static void
+summarize(unsigned long n)
+{
+	struct Itemspec itemspec = { 0 };
+	char buf[64];
+
+	/* replace the summary item with one that counts n more items */
+	n += queue.nmore;
+	if (queue.summary != NULL)
+		delitem(queue.summary);
+	itemspec.buf = buf;
+	itemspec.spec.title.len = snprintf(buf, sizeof(buf), "+%lu more", n);
+	itemspec.bar = -1;
+	itemspec.msec = lifetime;
+	queue.summary = additem(newitem(&itemspec));
+	queue.nmore = n;
+}
+
+static bool
+makeroom(void)
+{
+	/*
+	 * Make room in the queue for a new notification, according to the
+	 * overflow policy.  Return whether the new notification should be
+	 * added to the queue; if not, it was dropped or counted in the
+	 * frame, for realizeframe() to summarize all of them at once.
+	 */
+	if (queue.max == 0 || queue.nitems < queue.max)
+		return true;
+	queue.dropped[queue.overflow]++;
+	switch (queue.overflow) {
+	case DropOldest:
+		delitem(queue.head != queue.summary ? queue.head : queue.head->next);
+		return true;
+	case DropSummary:
+		frame.nmore++;
+		return false;
+	default:
+		return false;
+	}
+}
+
+static struct Bucket *
+getbucket(int kind, const char *name, size_t len, long long now)
+{
+	struct Bucket *bucket, **p, **q, **lru;
+	int i;
+
+	/* the name is not nul-terminated; it points into the notification */
+	p = &limits.buckets[(hashkey(name, len) ^ kind) % MAXBUCKETS];
+	for (bucket = *p; bucket != NULL; bucket = bucket->next)
+		if (bucket->kind == kind && strlen(bucket->name) == len &&
+		    memcmp(bucket->name, name, len) == 0)
+			return bucket;
+
+	/* too many buckets; forget the least recently used one */
+	if (limits.nbuckets >= MAXBUCKETS) {
+		lru = NULL;
+		for (i = 0; i < MAXBUCKETS; i++)
+			for (q = &limits.buckets[i]; *q != NULL; q = &(*q)->next)
+				if (lru == NULL || (*q)->last < (*lru)->last)
+					lru = q;
+		bucket = *lru;
+		*lru = bucket->next;
+		free(bucket);
+		limits.nbuckets--;
+	}
+
+	bucket = emalloc(sizeof(*bucket) + len + 1);
+	bucket->name = memcpy(bucket + 1, name, len);
+	bucket->name[len] = '\0';
+	bucket->kind = kind;
+	bucket->tokens = (kind == 't') ? limits.tagburst : limits.srcburst;
+	bucket->last = now;
+	bucket->passed = 0;
+	bucket->limited = 0;
+	bucket->next = *p;
+	*p = bucket;
+	limits.nbuckets++;
+	return bucket;
+}
+
+static bool
+takebucket(struct Bucket *bucket, int rate, int burst, long long now)
+{
+	/* refill the bucket for the time elapsed, and take a token from it */
+	bucket->tokens += (now - bucket->last) * rate / 60000.0;
+	bucket->tokens = MIN(bucket->tokens, MAX(burst, 1));
+	bucket->last = now;
+	if (bucket->tokens < 1.0) {
+		bucket->limited++;
+		return false;
+	}
+	bucket->tokens -= 1.0;
+	bucket->passed++;
+	return true;
+}
+
+static bool
+ratelimit(const struct Itemspec *itemspec, const char *source)
+{
+	const ParseSlice *tag;
+	struct Bucket *bucket;
+	long long now;
+	bool tagged;
+
+	/* return whether the notification exceeds the rate of its source or tag */
+	tagged = itemspec->spec.options & (1U << PARSE_TAG);
+	if (limits.srcrate == 0 && (limits.tagrate == 0 || !tagged))
+		return false;
+	now = getmsec();
+	if (limits.srcrate > 0) {
+		bucket = getbucket('s', source, strlen(source), now);
+		if (!takebucket(bucket, limits.srcrate, limits.srcburst, now))
+			return true;
+	}
+	if (limits.tagrate > 0 && tagged) {
+		tag = &itemspec->spec.option[PARSE_TAG];
+		bucket = getbucket('t', itemspec->buf + tag->off, tag->len, now);
+		if (!takebucket(bucket, limits.tagrate, limits.tagburst, now))
+			return true;
+	}
+	return false;
+}
+
+static void
+freebuckets(void)
+{
+	struct Bucket *bucket;
+	int i;
+
+	for (i = 0; i < MAXBUCKETS; i++) {
+		while ((bucket = limits.buckets[i]) != NULL) {
+			limits.buckets[i] = bucket->next;
+			free(bucket);
+		}
+	}
+	limits.nbuckets = 0;
+}
+
+static void
+queuespec(const struct Itemspec *itemspec, const char *source)
+{
+	struct Item *pending, *prev, *tmp, *next;
+
+	/* open a new frame, unless there is one already */
+	if (frame.head == NULL && frame.nmore == 0)
+		frame.deadline = getmsec() + frame_msec;
+
+	/* a flooding source or tag cannot get past this point */
+	if (ratelimit(itemspec, source)) {
+		metrics.ratelimited++;
+		if (queue.overflow == DropSummary)
+			frame.nmore++;
+		return;
+	}
+
+	/* the item is made now, and realized at the end of the frame */
+	pending = newitem(itemspec);
+	pending->id = metrics.received;
+	pending->received = getusec();
+
+	/* an untagged notification identical to a pending one is counted in it */
+	for (tmp = frame.head; !oflag && !pending->tag && tmp != NULL; tmp = tmp->next) {
+		if (!tmp->tag && tmp->hash == pending->hash && tmp->keylen == pending->keylen &&
+		    memcmp(tmp->key, pending->key, pending->keylen) == 0) {
+			TRACE2(coalesce, tmp->id, pending->id);
+			tmp->ndups++;
+			free(pending);
+			return;
+		}
+	}
+	frame.npending++;
+
+	/*
+	 * The latest notification wins: drop pending notifications that
+	 * would be removed as soon as this one is realized.
+	 */
+	prev = NULL;
+	for (tmp = frame.head; tmp != NULL; tmp = next) {
+		next = tmp->next;
+		if (oflag || (pending->tag && tmp->tag && strcmp(pending->tag, tmp->tag) == 0))
+			delpending(prev, tmp);
+		else
+			prev = tmp;
+	}
+
+	if (frame.head == NULL)
+		frame.head = pending;
+	else
+		frame.tail->next = pending;
+	frame.tail = pending;
+
+	/*
+	 * No more than a queue worth of notifications can be realized
+	 * at the end of the frame; apply the overflow policy right away
+	 * so a flood does not pile up in memory.
+	 */
+	if (queue.max == 0 || frame.npending <= queue.max)
+		return;
+	queue.dropped[queue.overflow]++;
+	switch (queue.overflow) {
+	case DropOldest:
+		delpending(NULL, frame.head);
+		break;
+	case DropSummary:
+		frame.nmore++;
+		/* FALLTHROUGH */
+	default:
+		for (prev = frame.head; prev->next != pending; prev = prev->next)
+			;
+		delpending(prev, pending);
+		break;
+	}
+}
+
+static void
+ingestline(const char *line, size_t len, const char *source)
+{
+	/* the line is parsed in place, in the buffer it was read into */
+	metrics.received++;
+	TRACE1(parse__start, metrics.received);
+	if (!parseline(&parsed, line, len)) {
+		TRACE2(parse__done, metrics.received, 0);
+		metrics.malformed++;
+		return;
+	}
+	TRACE2(parse__done, metrics.received, 1);
+	queuespec(&parsed, source);
+}
+
+static void
+ingestframe(const char *data, size_t len, const char *source)
+{
+	/* the frame is parsed in place, in the buffer it was read into */
+	metrics.received++;
+	TRACE1(parse__start, metrics.received);
+	if (!parseframe(&parsed, data, len)) {
+		TRACE2(parse__done, metrics.received, 0);
+		metrics.malformed++;
+		return;
+	}
+	TRACE2(parse__done, metrics.received, 1);
+	queuespec(&parsed, source);
+}
+
+static void
+realizeframe(void)
+{
+	struct Item *pending, *item;
+
+	/* realize the notifications that survived the frame, in one pass */
+	while ((pending = frame.head) != NULL) {
+		(void)unlinkpending(NULL, pending);
+		if (oflag) {
+			cleanitems(NULL);
+		} else if (pending->tag) {
+			cleanitems(pending->tag);
+		} else if ((item = getduplicate(pending)) != NULL) {
+			TRACE2(coalesce, item->id, pending->id);
+			coalesceitem(item, pending->ndups);
+			free(pending);
+			continue;
+		}
+		if (makeroom()) {
+			additem(pending);
+			queue.nitems++;
+			metrics.created++;
+			metrics.coalesced += pending->ndups - 1;
+		} else {
+			free(pending);
+		}
+	}
+	if (frame.nmore > 0)
+		summarize(frame.nmore);
+	frame.nmore = 0;
+}
+
+static int
+readinput(struct Input *input)
+{
+	size_t nread = 0;
+	ssize_t n;
+
+	/*
+	 * Drain everything available on the input (up to INPUTBATCH bytes),
+	 * so a burst of lines is handled in a single pass of the main loop.
+	 * Return -1 on end of file or error, 0 otherwise.
+	 */
+	while (nread < INPUTBATCH) {
+		if (input->beg > 0 && input->end >= input->size) {
+			/* move unparsed bytes to the beginning of the buffer */
+			memmove(input->buf, input->buf + input->beg, input->end - input->beg);
+			input->end -= input->beg;
+			input->beg = 0;
+		}
+		if (input->end >= input->size) {
+			input->size = (input->size == 0) ? INPUTSIZ : input->size * 2;
+			input->buf = erealloc(input->buf, input->size);
+		}
+		n = read(input->fd, input->buf + input->end, input->size - input->end);
+		if (n > 0) {
+			TRACE2(read, input->fd, n);
+			input->end += n;
+			nread += n;
+		} else if (n == 0) {
+			return -1;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		} else if (errno != EINTR) {
+			warn("read");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static char *
+nextframe(struct Input *input, size_t *len)
+{
+	char *p;
+	size_t avail;
+
+	/*
+	 * Return the fields of the next complete frame in the input
+	 * buffer, or NULL if there is none.  A frame begins with a nul
+	 * byte, which no line of text does, followed by the length of its
+	 * fields in four bytes (see parseframe()).
+	 */
+	avail = input->end - input->beg;
+	p = input->buf + input->beg;
+	if (avail < FRAMEHDR)
+		return NULL;
+	*len = getu32(p + 1);
+	if (*len > INPUTMAX) {
+		/* skip the frame, and resume with what follows it */
+		warnx("notification frame too long (%zu bytes), skipped", *len);
+		input->skip = FRAMEHDR + *len;
+		return NULL;
+	}
+	if (avail - FRAMEHDR < *len)
+		return NULL;
+	input->beg += FRAMEHDR + *len;
+	if (input->beg == input->end)
+		input->beg = input->end = 0;
+	return p + FRAMEHDR;
+}
+
+static char *
+nextline(struct Input *input, bool eof, size_t *len)
+{
+	char *line, *nl;
+	size_t size;
+
+	/*
+	 * Return the next complete line in the input buffer, and its length
+	 * in *len (without the newline), or NULL if there is none.  At end
+	 * of file, the last unterminated line is returned too.  Too long
+	 * lines are split at INPUTMAX bytes.
+	 */
+	size = input->end - input->beg;
+	if (size == 0)
+		return NULL;
+	line = input->buf + input->beg;
+	if ((nl = memchr(line, '\n', size)) != NULL) {
+		*len = nl - line;
+		size = *len + 1;
+	} else if (!eof && size < INPUTMAX) {
+		return NULL;
+	} else {
+		*len = size;
+	}
+	input->beg += size;
+	if (input->beg == input->end)
+		input->beg = input->end = 0;
+	return line;
+}
+
+static void
+ingestinput(struct Input *input, bool eof, const char *source)
+{
+	char *data;
+	size_t len;
+
+	/* ingest the complete lines and frames in the input buffer */
+	while (input->beg < input->end) {
+		if (input->skip > 0) {
+			len = MIN(input->skip, input->end - input->beg);
+			input->skip -= len;
+			input->beg += len;
+			if (input->beg == input->end)
+				input->beg = input->end = 0;
+		} else if (input->buf[input->beg] == '\0') {
+			if ((data = nextframe(input, &len)) == NULL) {
+				if (input->skip > 0)
+					continue;
+				break;
+			}
+			ingestframe(data, len, source);
+		} else {
+			if ((data = nextline(input, eof, &len)) == NULL)
+				break;
+			ingestline(data, len, source);
+		}
+	}
+}
 
-		texth += fonth;
+static int
+bindsocket(int fd, const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat sb;
+	int probe, ret;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+		return 0;
+	if (errno != EADDRINUSE)
+		return -1;
+
+	/* never remove anything but a socket */
+	if (lstat(path, &sb) == -1 || !S_ISSOCK(sb.st_mode)) {
+		errno = EADDRINUSE;
+		return -1;
 	}
 
-	/* resize notification window based on its contents */
-	newh = MAX(imgh, texth) + 2 * padding_pixels;
-	item->h = MAX(item->h, newh);
-	XResizeWindow(dpy, item->win, item->w, item->h);
+	/* replace the socket left by a previous instance, unless it is alive */
+	if ((probe = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	ret = connect(probe, (struct sockaddr *)&addr, sizeof(addr));
+	close(probe);
+	if (ret == 0 || errno != ECONNREFUSED) {
+		errno = EADDRINUSE;
+		return -1;
+	}
+	if (unlink(path) == -1)
+		return -1;
+	return bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+}
 
-	/* change border color */
-	XSetWindowBackgroundPixmap(dpy, item->win, pixmap);
-	XClearWindow(dpy, item->win);
-	XFreePixmap(dpy, pixmap);
-	XRenderFreePicture(dpy, picture);
-	XRenderFreePicture(dpy, fg);
-	XRenderFreePicture(dpy, alpha);
+static int
+listensocket(const char *path)
+{
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (bindsocket(fd, path) == -1)
+		err(1, "%s", path);
+	if (listen(fd, SOMAXCONN) == -1)
+		err(1, "listen");
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+	(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
 }
 
 static void
-resettime(struct Item *item)
+initserver(void)
 {
-	item->time = time(NULL);
+	if (server.path == NULL)
+		return;
+	server.fd = listensocket(server.path);
 }
 
-static char *
-estrdup(const char *s)
+static int
+peeruid(int fd, unsigned long *uid)
 {
-	char *t;
-
-	if ((t = strdup(s)) == NULL)
-		err(1, "strdup");
-	return t;
+#if defined(__linux__)
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return -1;
+	*uid = cred.uid;
+	return 0;
+#elif defined(__OpenBSD__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+      defined(__DragonFly__) || defined(__APPLE__)
+	uid_t euid;
+	gid_t egid;
+
+	if (getpeereid(fd, &euid, &egid) == -1)
+		return -1;
+	*uid = euid;
+	return 0;
+#else
+	(void)fd;
+	(void)uid;
+	return -1;
+#endif
 }
 
 static void
-additem(struct Itemspec *itemspec)
+clientsource(int fd, char *buf, size_t size)
 {
-	const char *text;
-	struct Item *item;
-	int w, i;
-
-	if ((item = malloc(sizeof *item)) == NULL)
-		err(1, "malloc");
-	item->next = NULL;
-	item->image = (itemspec->file) ? loadimage(itemspec->file) : NULL;
-	item->tag = (itemspec->tag) ? estrdup(itemspec->tag) : NULL;
-	item->cmd = (itemspec->cmd) ? estrdup(itemspec->cmd) : NULL;
-	item->sec = itemspec->sec;
-	item->bar = itemspec->bar;
-	if (!queue.head)
-		queue.head = item;
-	else
-		queue.tail->next = item;
-	item->prev = queue.tail;
-	queue.tail = item;
+	static unsigned long nconns = 0;
+	unsigned long uid;
 
-	/* allocate texts */
-	item->line[0] = (itemspec->firstline) ? estrdup(itemspec->firstline) : NULL;
-	text = strtok(itemspec->otherlines, "\t\n");
-	for (i = 1; i < MAXLINES && text != NULL; i++) {
-		item->line[i] = estrdup(text);
-		text = strtok(NULL, "\t\n");
+	/* the connections of a user share a rate limit */
+	if (peeruid(fd, &uid) == 0) {
+		(void)snprintf(buf, size, "socket:%lu", uid);
+		return;
 	}
-	item->nlines = i;
 
-	/* allocate colors */
-	item->background = background;
-	item->foreground = foreground;
-	item->borderclr = borderclr;
-	setcolor(&item->background, itemspec->background);
-	setcolor(&item->foreground, itemspec->foreground);
-	setcolor(&item->borderclr, itemspec->border);
+	/*
+	 * Without credentials, each connection has its own, which a
+	 * client can get around by connecting again with a full burst.
+	 */
+	(void)snprintf(buf, size, "socket#%lu", ++nconns);
+}
 
-	/* compute notification width and height */
-	item->imgw = image_pixels;
-	item->h = queue.h;
-	for (i = 0; i < item->nlines; i++) {
-		text = item->line[i];
-		w = ctrlfnt_width(fontset, text, strlen(text));
-	}
-	if (shrink) {
-		if (item->image) {
-			item->textw = queue.w - image_pixels - padding_pixels * 3;
-			item->textw = MIN(w, item->textw);
-			item->w = item->textw + image_pixels + padding_pixels * 3;
-		} else {
-			item->textw = queue.w - padding_pixels * 2;
-			item->textw = MIN(w, item->textw);
-			item->w = item->textw + padding_pixels * 2;
+static void
+acceptclient(void)
+{
+	int fd;
+
+	while (server.nclients < MAXCLIENTS) {
+		if ((fd = accept(server.fd, NULL, NULL)) == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR && errno != ECONNABORTED)
+				warn("accept");
+			return;
 		}
-	} else {
-		item->w = queue.w;
-		if (item->image) {
-			item->textw = queue.w - image_pixels - padding_pixels * (2 + (item->line[0] ? 1 : 0));
-			if (!image_pixels) {
-				item->textw = MIN(item->textw, w);
-			}
-			item->imgw = queue.w - item->textw - padding_pixels * (2 + (item->line[0] ? 1 : 0));
-		} else {
-			item->textw = queue.w - padding_pixels * 2;
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+			warn("fcntl");
+			close(fd);
+			continue;
 		}
+		(void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+		server.clients[server.nclients++] = (struct Input){
+			.fd = fd,
+			.buf = NULL,
+			.size = 0,
+			.beg = 0,
+			.end = 0,
+		};
+		clientsource(fd, server.clients[server.nclients - 1].source,
+		             sizeof(server.clients[server.nclients - 1].source));
 	}
+}
 
-	/* call functions that set the item */
-	createwindow(item);
-	resettime(item);
-	drawitem(item);
+static void
+readclient(int i)
+{
+	struct Input *client;
+	bool eof;
 
-	/* a new item was added to the queue, so the queue changed */
-	queue.change = true;
+	/*
+	 * Each connection has its own buffer, so lines of concurrent
+	 * clients never mix, and a slow client only holds its own
+	 * unfinished line.
+	 */
+	client = &server.clients[i];
+	eof = (readinput(client) == -1);
+	ingestinput(client, eof, client->source);
+
+	/* rather than skipping a frame too long, drop the client that sent it */
+	if (!eof && client->skip == 0)
+		return;
+	close(client->fd);
+	free(client->buf);
+	server.clients[i] = server.clients[--server.nclients];
 }
 
 static void
-delitem(struct Item *item)
+termserver(void)
 {
 	int i;
 
-	for (i = 0; i < item->nlines; i++)
-		free(item->line[i]);
-	XDestroyWindow(dpy, item->win);
-	if (item->prev)
-		item->prev->next = item->next;
-	else
-		queue.head = item->next;
-	if (item->next)
-		item->next->prev = item->prev;
-	else
-		queue.tail = item->prev;
-	free(item);
-	queue.change = true;
+	if (server.fd == -1)
+		return;
+	for (i = 0; i < server.nclients; i++) {
+		close(server.clients[i].fd);
+		free(server.clients[i].buf);
+	}
+	server.nclients = 0;
+	close(server.fd);
+	(void)unlink(server.path);
+	server.fd = -1;
 }
 
 static void
-cmditem(struct Item *item)
+puthelp(FILE *fp, const char *name, const char *type, const char *help)
 {
-	if (item->cmd != NULL)
-		printf("%s\n", item->cmd);
-	fflush(stdout);
+	fprintf(fp, "# HELP xnotify_%s %s\n", name, help);
+	fprintf(fp, "# TYPE xnotify_%s %s\n", name, type);
 }
 
-static enum ItemOption
-optiontype(const char *s)
-{
-	if (strncmp(s, "IMG:", 4) == 0)
-		return IMG;
-	if (strncmp(s, "BG:", 3) == 0)
-		return BG;
-	if (strncmp(s, "FG:", 3) == 0)
-		return FG;
-	if (strncmp(s, "BRD:", 4) == 0)
-		return BRD;
-	if (strncmp(s, "TAG:", 4) == 0)
-		return TAG;
-	if (strncmp(s, "CMD:", 4) == 0)
-		return CMD;
-	if (strncmp(s, "SEC:", 4) == 0)
-		return SEC;
-	if (strncmp(s, "BAR:", 4) == 0)
-		return BAR;
-	return UNKNOWN;
+static void
+putcounter(FILE *fp, const char *name, const char *help, unsigned long value)
+{
+	puthelp(fp, name, "counter", help);
+	fprintf(fp, "xnotify_%s %lu\n", name, value);
 }
 
-static bool
-parseline(struct Itemspec *itemspec, char *s)
+static void
+putgauge(FILE *fp, const char *name, const char *help, unsigned long value)
 {
-	enum ItemOption option;
-	const char *t;
-	int n;
+	puthelp(fp, name, "gauge", help);
+	fprintf(fp, "xnotify_%s %lu\n", name, value);
+}
 
-	/* get the filename */
-	itemspec->file = NULL;
-	itemspec->foreground = NULL;
-	itemspec->background = NULL;
-	itemspec->border = NULL;
-	itemspec->tag = NULL;
-	itemspec->cmd = NULL;
-	itemspec->bar = -1;
-	itemspec->sec = seconds;
-	itemspec->firstline = strtok(s, "\t\n");
-	while (itemspec->firstline && (option = optiontype(itemspec->firstline)) != UNKNOWN) {
-		switch (option) {
-		case IMG:
-			itemspec->file = itemspec->firstline + 4;
-			itemspec->firstline = strtok(NULL, "\t\n");
-			break;
-		case BG:
-			itemspec->background = itemspec->firstline + 3;
-			itemspec->firstline = strtok(NULL, "\t\n");
-			break;
-		case FG:
-			itemspec->foreground = itemspec->firstline + 3;
-			itemspec->firstline = strtok(NULL, "\t\n");
-			break;
-		case BRD:
-			itemspec->border = itemspec->firstline + 4;
-			itemspec->firstline = strtok(NULL, "\t\n");
-			break;
-		case TAG:
-			itemspec->tag = itemspec->firstline + 4;
-			itemspec->firstline = strtok(NULL, "\t\n");
-			break;
-		case CMD:
-			itemspec->cmd = itemspec->firstline + 4;
-			itemspec->firstline = strtok(NULL, "\t\n");
-			break;
-		case BAR:
-			t = itemspec->firstline + 4;
-			if (!getnum(&t, &n) && n >= 0 && n <= 100)
-				itemspec->bar = n;
-			else
-				itemspec->bar = -1;
-			itemspec->firstline = strtok(NULL, "\t\n");
-			break;
-		case SEC:
-			t = itemspec->firstline + 4;
-			if (!getnum(&t, &n))
-				itemspec->sec = n;
-			itemspec->firstline = strtok(NULL, "\t\n");
-			break;
-		default:
-			break;
+static void
+putlabel(FILE *fp, const char *s)
+{
+	/* write a label value, escaped as the text format wants */
+	for (; *s != '\0'; s++) {
+		if (*s == '\\' || *s == '"')
+			fprintf(fp, "\\%c", *s);
+		else if (*s == '\n')
+			fputs("\\n", fp);
+		else
+			fputc(*s, fp);
+	}
+}
+
+static void
+putbuckets(FILE *fp, const char *name, const char *help, bool limited)
+{
+	struct Bucket *bucket;
+	int i;
+
+	/*
+	 * The counts of a bucket restart when it is forgotten, see
+	 * getbucket().  Overlong names are left out to bound the output.
+	 */
+	puthelp(fp, name, "counter", help);
+	for (i = 0; i < MAXBUCKETS; i++) {
+		for (bucket = limits.buckets[i]; bucket != NULL; bucket = bucket->next) {
+			if (strlen(bucket->name) > MAXLABEL)
+				continue;
+			fprintf(fp, "xnotify_%s{%s=\"", name,
+			        bucket->kind == 't' ? "tag" : "source");
+			putlabel(fp, bucket->name);
+			fprintf(fp, "\"} %lu\n", limited ? bucket->limited : bucket->passed);
 		}
 	}
+}
+
+static void
+puthistogram(FILE *fp, const char *name, const char *help, const struct Histogram *hist)
+{
+	unsigned long n = 0;
+	int i;
 
-	/* get the body */
-	itemspec->otherlines = strtok(NULL, "\n");
-	if (itemspec->otherlines)
-		while (*itemspec->otherlines == '\t')
-			itemspec->otherlines++;
+	/* the buckets of the text format are cumulative */
+	puthelp(fp, name, "histogram", help);
+	for (i = 0; i < NHISTBUCKETS; i++) {
+		n += hist->counts[i];
+		fprintf(fp, "xnotify_%s_bucket{le=\"%g\"} %lu\n", name, histbounds[i], n);
+	}
+	fprintf(fp, "xnotify_%s_bucket{le=\"+Inf\"} %lu\n", name, hist->count);
+	fprintf(fp, "xnotify_%s_sum %.6f\n", name, hist->sum);
+	fprintf(fp, "xnotify_%s_count %lu\n", name, hist->count);
+}
 
-	if (!itemspec->firstline && !itemspec->file)
-		return false;
+static void
+writemetrics(FILE *fp)
+{
+	static const char *policies[NOVERFLOWS] = {
+		[DropOldest]  = "oldest",
+		[DropNewest]  = "newest",
+		[DropSummary] = "summary",
+	};
+	CtrlFontStats fstats;
+	int i;
 
-	return true;
+	/* write the metrics in the text exposition format of Prometheus */
+	putcounter(fp, "notifications_received_total",
+	           "Notification lines and frames read.", metrics.received);
+	putcounter(fp, "notifications_malformed_total",
+	           "Notifications that could not be parsed.", metrics.malformed);
+	putcounter(fp, "notifications_ratelimited_total",
+	           "Notifications over the rate limit of their source or tag.",
+	           metrics.ratelimited);
+	putbuckets(fp, "ratelimit_passed_total",
+	           "Notifications let through by the rate limit of a source or tag.",
+	           false);
+	putbuckets(fp, "ratelimit_limited_total",
+	           "Notifications over the rate limit of a source or tag.",
+	           true);
+	putcounter(fp, "notifications_coalesced_total",
+	           "Notifications counted in an identical one on the screen.",
+	           metrics.coalesced);
+	puthelp(fp, "notifications_dropped_total", "counter",
+	        "Notifications dropped by the overflow policy.");
+	for (i = 0; i < NOVERFLOWS; i++)
+		fprintf(fp, "xnotify_notifications_dropped_total{policy=\"%s\"} %lu\n",
+		        policies[i], queue.dropped[i]);
+	putcounter(fp, "items_created_total",
+	           "Notification windows created.", metrics.created);
+	putcounter(fp, "items_expired_total",
+	           "Notification windows closed by their timeout.", metrics.expired);
+	putcounter(fp, "items_clicked_total",
+	           "Notification windows closed by a click.", metrics.clicked);
+	putgauge(fp, "queue_items",
+	         "Notifications on the screen.", queue.nitems);
+	putgauge(fp, "frame_pending",
+	         "Notifications waiting for the end of the frame.", frame.npending);
+	putgauge(fp, "socket_clients",
+	         "Connections to the notification socket.", server.nclients);
+	putcounter(fp, "image_cache_hits_total",
+	           "Images found in the image cache.", images.hits);
+	putcounter(fp, "image_cache_misses_total",
+	           "Images not found in the image cache.", images.misses);
+	putgauge(fp, "image_cache_bytes",
+	         "Memory used by the image cache.", images.nbytes);
+	ctrlfnt_stats(fontset, &fstats);
+	putcounter(fp, "width_cache_hits_total",
+	           "Text widths found in the width cache.", fstats.width_hits);
+	putcounter(fp, "width_cache_misses_total",
+	           "Text widths not found in the width cache.", fstats.width_misses);
+	putcounter(fp, "font_matches_total",
+	           "Fontconfig queries for a fallback font.", fstats.font_matches);
+	putcounter(fp, "font_char_lookups_total",
+	           "Lookups of the font covering a glyph.", fstats.char_lookups);
+	putcounter(fp, "font_fallback_opens_total",
+	           "Fallback fonts opened.", fstats.fallback_opens);
+	putcounter(fp, "font_fallback_misses_total",
+	           "Glyphs no font could draw.", fstats.fallback_misses);
+	puthistogram(fp, "notification_latency_seconds",
+	             "Time from reading a notification to mapping its window.",
+	             &metrics.latency);
+	puthistogram(fp, "draw_seconds",
+	             "Time spent drawing a notification.", &metrics.draw);
+	puthistogram(fp, "image_decode_seconds",
+	             "Time spent loading and scaling an image.", &metrics.decode);
 }
 
 static void
-timeitems(void)
+initmetrics(void)
 {
-	struct Item *item;
-	struct Item *tmp;
+	if (metrics.path == NULL)
+		return;
+	metrics.fd = listensocket(metrics.path);
+}
 
-	item = queue.head;
-	while (item) {
-		tmp = item;
-		item = item->next;
-		if (tmp->sec && time(NULL) - tmp->time >= tmp->sec) {
-			delitem(tmp);
+static void
+sendall(int fd, const char *buf, size_t size)
+{
+	struct pollfd pfd;
+	long long deadline;
+	ssize_t n;
+
+	/* a client gets METRICSWAIT milliseconds to read what does not fit */
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	deadline = getmsec() + METRICSWAIT;
+	while (size > 0) {
+		if ((n = send(fd, buf, size, MSG_NOSIGNAL)) > 0) {
+			buf += n;
+			size -= n;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			if (getmsec() >= deadline ||
+			    poll(&pfd, 1, MAX(deadline - getmsec(), 0)) == 0) {
+				warnx("metrics not read in time, %zu bytes left", size);
+				return;
+			}
+		} else if (errno != EINTR) {
+			if (errno != EPIPE)
+				warn("send");
+			return;
 		}
 	}
 }
 
 static void
-moveitems(void)
+sendmetrics(void)
 {
-	struct Item *item;
-	int x, y;
-	int h = 0;
+	FILE *fp;
+	char *buf = NULL;
+	size_t size = 0;
+	int fd;
 
 	/*
-	 * A notification has been deleted or added;
-	 * reorder the queue of notifications
+	 * Write the metrics to each new connection and close it.  A
+	 * client that does not read them cannot hold us for long; see
+	 * sendall().
 	 */
-	for (item = queue.head; item; item = item->next) {
-		x = queue.x + mon.x;
-		y = queue.y + mon.y;
-		switch (gravity) {
-		case NorthWestGravity:
-			break;
-		case NorthGravity:
-			x += (mon.w - item->w) / 2 - border_pixels;
-			break;
-		case NorthEastGravity:
-			x += mon.w - item->w - border_pixels * 2;
-			break;
-		case WestGravity:
-			y += (mon.h - item->h) / 2 - border_pixels;
-			break;
-		case CenterGravity:
-			x += (mon.w - item->w) / 2 - border_pixels;
-			y += (mon.h - item->h) / 2 - border_pixels;
-			break;
-		case EastGravity:
-			x += mon.w - item->w - border_pixels * 2;
-			y += (mon.h - item->h) / 2 - border_pixels;
-			break;
-		case SouthWestGravity:
-			y += mon.h - item->h - border_pixels * 2;
-			break;
-		case SouthGravity:
-			x += (mon.w - item->w) / 2 - border_pixels;
-			y += mon.h - item->h - border_pixels * 2;
-			break;
-		case SouthEastGravity:
-			x += mon.w - item->w - border_pixels * 2;
-			y += mon.h - item->h - border_pixels * 2;
-			break;
+	while ((fd = accept(metrics.fd, NULL, NULL)) != -1) {
+		if (buf == NULL) {
+			if ((fp = open_memstream(&buf, &size)) == NULL) {
+				warn("open_memstream");
+				close(fd);
+				return;
+			}
+			writemetrics(fp);
+			fclose(fp);
 		}
-
-		if (direction == DownWards)
-			y += h;
-		else
-			y -= h;
-		h += item->h + gap_pixels + border_pixels * 2;
-		XMoveWindow(dpy, item->win, x, y);
-		XMapWindow(dpy, item->win);
+		(void)fcntl(fd, F_SETFL, O_NONBLOCK);
+		sendall(fd, buf, size);
+		close(fd);
 	}
-
-	queue.change = false;
+	if (errno != EAGAIN && errno != EWOULDBLOCK &&
+	    errno != EINTR && errno != ECONNABORTED)
+		warn("accept");
+	free(buf);
 }
 
 static void
-cleanitems(const char *tag)
+dumpmetrics(void)
 {
-	struct Item *item;
-	struct Item *tmp;
+	char tmp[PATH_MAX];
+	FILE *fp;
 
-	/*
-	 * Free all notification items of the given tag;
-	 * or free all items if tag is NULL
-	 */
-	item = queue.head;
-	while (item) {
-		tmp = item;
-		item = item->next;
-		if (tag == NULL || (tmp->tag && strcmp(tmp->tag, tag) == 0)) {
-			delitem(tmp);
-		}
+	/* replace the file at once, so a reader never sees half of it */
+	if (metrics.dumppath == NULL)
+		return;
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", metrics.dumppath) >= (int)sizeof(tmp)) {
+		warnx("%s: path too long", metrics.dumppath);
+		return;
+	}
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		warn("%s", tmp);
+		return;
+	}
+	writemetrics(fp);
+	if (fclose(fp) == EOF) {
+		warn("%s", tmp);
+		(void)unlink(tmp);
+		return;
 	}
+	if (rename(tmp, metrics.dumppath) == -1)
+		warn("%s", metrics.dumppath);
+}
+
+static void
+termmetrics(void)
+{
+	dumpmetrics();
+	if (metrics.fd == -1)
+		return;
+	close(metrics.fd);
+	(void)unlink(metrics.path);
+	metrics.fd = -1;
 }
 
 static char *
@@ -1126,7 +3536,7 @@ parseresources(const char *str)
 	enum Resource res;
 	XRenderColor *color;
 	double d;
-	int n, *num;
+	int n, max, *num;
 
 	if (str == NULL)
 		return;
@@ -1146,6 +3556,16 @@ parseresources(const char *str)
 			else
 				warnx("%s: unknown alignment", value);
 			break;
+		case RES_OVERFLOW:
+			if (strcasecmp(value, "Oldest") == 0)
+				queue.overflow = DropOldest;
+			else if (strcasecmp(value, "Newest") == 0)
+				queue.overflow = DropNewest;
+			else if (strcasecmp(value, "Summary") == 0)
+				queue.overflow = DropSummary;
+			else
+				warnx("%s: unknown overflow policy", value);
+			break;
 		case RES_BACKGROUND:
 		case RES_FOREGROUND:
 		case RES_BORDERCLR:
@@ -1188,6 +3608,61 @@ parseresources(const char *str)
 			else
 				*num = n;
 			break;
+		case RES_FRAMETIME:
+			n = strtol(value, &endp, 10);
+			if (n > 1000 || n < 0 || endp == value)
+				warnx("%s: invalid time", value);
+			else
+				frame_msec = n;
+			break;
+		case RES_MAXITEMS:
+		case RES_WIDTHCACHE:
+		case RES_WINPOOL:
+		case RES_WINPOOLMAX:
+			if (res == RES_MAXITEMS) {
+				num = &maxitems;
+				max = 65536;
+			} else if (res == RES_WIDTHCACHE) {
+				num = &widthcache_size;
+				max = 65536;
+			} else if (res == RES_WINPOOL) {
+				num = &winpool_size;
+				max = 256;
+			} else if (res == RES_WINPOOLMAX) {
+				num = &winpool.max;
+				max = 256;
+			}
+			n = strtol(value, &endp, 10);
+			if (n > max || n < 0 || endp == value)
+				warnx("%s: invalid number", value);
+			else
+				*num = n;
+			break;
+		case RES_IMAGECACHE:
+			n = strtol(value, &endp, 10);
+			if (n < 0 || endp == value)
+				warnx("%s: invalid size", value);
+			else
+				imagecache_size = n;
+			break;
+		case RES_SRCBURST:
+		case RES_SRCRATE:
+		case RES_TAGBURST:
+		case RES_TAGRATE:
+			if (res == RES_SRCBURST)
+				num = &limits.srcburst;
+			else if (res == RES_SRCRATE)
+				num = &limits.srcrate;
+			else if (res == RES_TAGBURST)
+				num = &limits.tagburst;
+			else if (res == RES_TAGRATE)
+				num = &limits.tagrate;
+			n = strtol(value, &endp, 10);
+			if (n < 0 || endp == value)
+				warnx("%s: invalid rate", value);
+			else
+				*num = n;
+			break;
 		case RES_GEOMETRY:
 			parsegeometry(&queue, value);
 			break;
@@ -1294,15 +3769,48 @@ setup(void)
 		case RES_IMAGEWID:
 			image_pixels = resdefs[res].value;
 			break;
+		case RES_IMAGECACHE:
+			imagecache_size = resdefs[res].value;
+			break;
 		case RES_BORDERWID:
 			border_pixels = resdefs[res].value;
 			break;
 		case RES_MAXHEIGHT:
 			max_height = resdefs[res].value;
 			break;
+		case RES_MAXITEMS:
+			maxitems = resdefs[res].value;
+			break;
+		case RES_OVERFLOW:
+			queue.overflow = resdefs[res].value;
+			break;
+		case RES_SRCBURST:
+			limits.srcburst = resdefs[res].value;
+			break;
+		case RES_SRCRATE:
+			limits.srcrate = resdefs[res].value;
+			break;
+		case RES_TAGBURST:
+			limits.tagburst = resdefs[res].value;
+			break;
+		case RES_TAGRATE:
+			limits.tagrate = resdefs[res].value;
+			break;
 		case RES_GAP:
 			gap_pixels = resdefs[res].value;
 			break;
+		case RES_FRAMETIME:
+			frame_msec = resdefs[res].value;
+			break;
+		case RES_WIDTHCACHE:
+			widthcache_size = resdefs[res].value;
+			break;
+		case RES_WINPOOL:
+			winpool_size = resdefs[res].value;
+			break;
+		case RES_WINPOOLMAX:
+			winpool.max = resdefs[res].value;
+			break;
 		case RES_GRAVITY:
 			gravity = resdefs[res].value;
 			break;
@@ -1342,23 +3850,30 @@ setup(void)
 	alphaformat = XRenderFindStandardFormat(dpy, PictStandardA8);
 	if (alphaformat == NULL)
 		errx(EXIT_FAILURE, "could not find XRender visual format");
-	imlib_set_cache_size(2048 * 1024);
+	/* decoded images are cached by us, not by Imlib2 */
+	imlib_set_cache_size(0);
 	imlib_context_set_dither(1);
 	imlib_context_set_display(dpy);
 	imlib_context_set_visual(visual);
 	imlib_context_set_colormap(colormap);
 
 	parseresources(XResourceManagerString(dpy));
+	images.maxbytes = (size_t)imagecache_size * 1024;
+	queue.max = maxitems;
+	initjobs();
 	if (fontset == NULL)
 		setfont(NULL, 0.0);
 	if (fontset == NULL) {
 		errx(EXIT_FAILURE, "could not load any font");
 	}
+	if (ctrlfnt_cache(fontset, widthcache_size) == -1)
+		warnx("could not allocate text width cache");
 }
 
 static void
 cleanup(void)
 {
+	termjobs();
 	XFreeColormap(dpy, colormap);
 	XCloseDisplay(dpy);
 }
@@ -1367,7 +3882,6 @@ static void
 readevent(void)
 {
 	struct Item *item;
-	struct Itemspec itemspec;
 	char *name;
 	XEvent ev;
 
@@ -1377,6 +3891,7 @@ readevent(void)
 			break;
 		if ((ev.xbutton.button == actionbutton) && item->cmd)
 			cmditem(item);
+		metrics.clicked++;
 		delitem(item);
 		break;
 	case MotionNotify:
@@ -1386,7 +3901,7 @@ readevent(void)
 	case ConfigureNotify:   /* monitor arrangement changed */
 		if (ev.xconfigure.window == root) {
 			initmonitor();
-			queue.change = true;
+			dirtyitem(queue.head);
 		}
 		break;
 	case PropertyNotify:
@@ -1397,15 +3912,7 @@ readevent(void)
 		if (rflag && ev.xproperty.atom == XA_WM_NAME) {
 			if ((name = gettextprop(root, XA_WM_NAME)) == NULL)
 				break;
-			if (parseline(&itemspec, name)) {
-				if (oflag) {
-					cleanitems(NULL);
-				} else if (itemspec.tag) {
-					cleanitems(itemspec.tag);
-				}
-				additem(&itemspec);
-			}
-			queue.change = true;
+			ingestline(name, strlen(name), "root");
 			free(name);
 		}
 		break;
@@ -1415,13 +3922,14 @@ readevent(void)
 int
 main(int argc, char *argv[])
 {
-	struct Itemspec itemspec;
-	struct pollfd pfd[2];   /* [2] for stdin and xfd, see poll(2) */
+	struct Input input;     /* buffered stdin */
+	struct pollfd pfd[5 + MAXCLIENTS];      /* stdin, xfd, jobs, metrics, socket and its clients */
 	const char *geomspec;
-	char buf[BUFSIZ];       /* buffer for stdin */
 	int timeout = -1;       /* maximum interval for poll(2) to complete */
+	long long now;
 	int flags;              /* status flags for stdin */
 	int reading = 1;        /* set to 0 when stdin reaches EOF */
+	int i;
 
 	geomspec = NULL;
 	saveargc = argc;
@@ -1435,6 +3943,9 @@ main(int argc, char *argv[])
 
 	/* set up queue of notifications */
 	setqueue(geomspec);
+	initwindows();
+	initserver();
+	initmetrics();
 
 	/* Make stdin nonblocking */
 	if ((flags = fcntl(STDIN_FILENO, F_GETFL)) == -1)
@@ -1442,40 +3953,58 @@ main(int argc, char *argv[])
 	if (fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK) == -1)
 		err(1, "could not set status flags for stdin");
 
-	/* disable buffering */
-	setbuf(stdin, NULL);
+	/* stdin is read with read(2) into our own buffer */
+	input = (struct Input){
+		.fd = STDIN_FILENO,
+		.buf = NULL,
+		.size = 0,
+		.beg = 0,
+		.end = 0,
+	};
 
 	/* prepare the structure for poll(2) */
 	pfd[0].fd = STDIN_FILENO;
 	pfd[1].fd = xfd;
-	pfd[0].events = pfd[1].events = POLLIN;
+	pfd[2].fd = jobs.pipefd[0];
+	pfd[3].fd = metrics.fd;
+	pfd[0].events = pfd[1].events = pfd[2].events = POLLIN;
+	pfd[3].events = pfd[4].events = POLLIN;
 
 	/* run main loop */
 	sigflag = SIGNAL_NONE;
 	do {
-		if (poll(pfd, 2, timeout) > 0) {
-			if (pfd[0].revents & POLLHUP) {
-				pfd[0].fd = -1;
-				reading = 0;
-			}
-			if (pfd[0].revents & POLLIN) {
-				if (fgets(buf, sizeof buf, stdin) == NULL) {
+		/* stop accepting connections while there is no room for them */
+		pfd[4].fd = (server.nclients < MAXCLIENTS) ? server.fd : -1;
+		for (i = 0; i < server.nclients; i++) {
+			pfd[5 + i].fd = server.clients[i].fd;
+			pfd[5 + i].events = POLLIN;
+		}
+		if (poll(pfd, 5 + server.nclients, timeout) > 0) {
+			if (pfd[0].revents & (POLLIN | POLLHUP)) {
+				if (readinput(&input) == -1) {
 					pfd[0].fd = -1;
 					reading = 0;
-					continue;
-				}
-				if (parseline(&itemspec, buf)) {
-					if (oflag) {
-						cleanitems(NULL);
-					} else if (itemspec.tag) {
-						cleanitems(itemspec.tag);
-					}
-					additem(&itemspec);
 				}
+				ingestinput(&input, !reading, "stdin");
 			}
 			if (pfd[1].revents & POLLIN) {
 				readevent();
 			}
+			if (pfd[2].revents & POLLIN) {
+				readjobs();
+			}
+			if (pfd[3].revents & POLLIN) {
+				sendmetrics();
+			}
+			/* backwards, as a closed connection is replaced by the last one */
+			for (i = server.nclients - 1; i >= 0; i--) {
+				if (pfd[5 + i].revents & (POLLIN | POLLHUP | POLLERR)) {
+					readclient(i);
+				}
+			}
+			if (pfd[4].revents & POLLIN) {
+				acceptclient();
+			}
 		}
 		if (sigflag != SIGNAL_NONE) {
 			switch (sigflag) {
@@ -1490,16 +4019,34 @@ main(int argc, char *argv[])
 			case SIGNAL_KILLALL:
 				cleanitems(NULL);
 				break;
+			case SIGNAL_DUMP:
+				dumpmetrics();
+				break;
 			}
 			sigflag = SIGNAL_NONE;
 		}
-		timeitems();
-		if (queue.change)
-			moveitems();
-		timeout = (queue.head) ? 1000 : -1;
+		now = getmsec();
+		if ((frame.head != NULL || frame.nmore > 0) && (now >= frame.deadline || (!reading && server.fd == -1)))
+			realizeframe();
+		timeout = timeitems(now);
+		moveitems();
+		timeout = mintimeout(timeout, trimpool(now));
+		if (frame.head != NULL || frame.nmore > 0)
+			timeout = mintimeout(timeout, MAX(frame.deadline - now, 0));
 		XFlush(dpy);
-	} while (rflag || reading || queue.head);
+	} while (rflag || reading || server.fd != -1 || queue.head || frame.head || frame.nmore);
+	termserver();
+	termmetrics();
 	cleanitems(NULL);
+	freebuckets();
+	free(timers.items);
+	free(idx.winbuckets);
+	free(idx.tagbuckets);
+	free(idx.dupbuckets);
+	termwindows();
+	(void)trimpool(LLONG_MAX);
+	free(input.buf);
+	free(parsed.lines);
 	cleanup();
 	return EXIT_SUCCESS;
 }